@@ -29,7 +29,7 @@ const string Title = "GCM Info Tool";
 string getinfo(string fn) {
 	gamecube::gcm iso;
 
-	if(!iso.open(new filestream(fn)))
+	if(!iso.open(new bufferedstream(fn, file::mode::read), true))
 		return "Unable to open and parse disk image.";
 
 	return {
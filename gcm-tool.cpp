@@ -15,8 +15,14 @@
  *
  */
 
+#include <atomic>
+#include <thread>
+
 #include <nall/nall.hpp>
 #include <nall/string.hpp>
+#include <nall/aio.hpp>
+#include <nall/bufferpool.hpp>
+#include <nall/workpool.hpp>
 #include <phoenix/phoenix.hpp>
 #include <gcm.hpp>
 
@@ -25,65 +31,755 @@ using namespace phoenix;
 
 const string Title = "GCM Tool";
 
-void extractDir(gamecube::fst::entry root, string target) {
-	directory::create(target);
+// Block size for buffered file access; 0 selects plain, unbuffered streams.
+unsigned blockSize = bufferedstream::defaultblocksize;
+
+// Reads and writes kept in flight at once while moving file data; 0 moves
+// it synchronously through the streams instead.
+unsigned queueDepth = 32;
+
+// Threads extracting files at once; 0 or 1 leaves unpack to the async
+// engine. Each thread moves data that the kernel can't copy by itself
+// through its own buffer of threadBuffer bytes, taking files in the order
+// chosen by extractOrder.
+unsigned jobs = 0;
+unsigned threadBuffer = 1024 * 1024;
+enum class order : unsigned { tree, disc, size } extractOrder = order::disc;
+
+// Which files unpack writes, by their path under root/ or sys/ (such as
+// "audio/bgm.adp" or "sys/main.dol"), matched case-insensitively. Given
+// includes, only matching files are written; excludes then drop some of
+// those. Files under root/ are cut down to rangeLength bytes starting at
+// rangeStart. Nothing is read for files left out.
+lstring includes, excludes;
+uint64_t rangeStart = 0, rangeLength = ~0ull;
+
+// Unpacks into an existing directory, leaving files that are already up to
+// date alone. What was written is recorded in cacheName under the output
+// directory; unchanged holds, by FST index, the files that need no writing.
+bool incremental = false;
+const char *cacheName = ".unpack-cache";
+vector<bool> unchanged;
+
+// Unpacks by reading the image once, front to back, instead of file by file.
+bool sweepImage = false;
+
+// Writes images with direct I/O, keeping them out of the page cache.
+bool directIO = false;
+
+// Size of each individual transfer queued on the async engine, and of the
+// buffers data is moved through; shrunk to fit under --memory.
+unsigned chunkSize = 1024 * 1024;
+
+// How repack aligns file data and whether it packs small files.
+gamecube::fst::packing packing;
+
+// Read trace for repack: one file path or image offset per line, in the
+// order the files were read. Offsets refer to files in traceImage.
+string traceFile, traceImage;
+
+bool filtering() {
+	return includes.size() || excludes.size();
+}
+
+bool selected(const string &path) {
+	bool wanted = includes.size() == 0;
+	for(auto &pattern : includes)
+		if(path.iwildcard(pattern)) wanted = true;
+	for(auto &pattern : excludes)
+		if(path.iwildcard(pattern)) wanted = false;
+	return wanted;
+}
+
+// Narrows the extent of file n to what unpack writes of it; false if the
+// file isn't written at all.
+bool selectFile(gamecube::fst &fs, unsigned n, uint64_t &offset, uint64_t &length) {
+	if(n < unchanged.size() && unchanged[n])
+		return false;
+	if(filtering() && !selected(fs.path(n)))
+		return false;
+	uint64_t skip = min(rangeStart, length);
+	offset += skip;
+	length = min(length - skip, rangeLength);
+	return true;
+}
+
+// File extents come from the image's own table, so they may point past
+// its end; nothing is read from one that does.
+bool inImage(stream *image, uint64_t offset, uint64_t length) {
+	return offset <= image->size() && length <= image->size() - offset;
+}
+
+stream *openFile(string filename, file::mode mode) {
+	if(blockSize) return new bufferedstream(filename, mode, blockSize);
+	return new filestream(filename, mode);
+}
+
+// Queues a copy of length bytes from one descriptor to another, one chunk
+// at a time, each read feeding its own write through a buffer borrowed from
+// pool. If source is set, the bytes are already in memory and are written
+// out directly. done runs once every chunk has been written.
+void queueCopy(aio &engine, bufferpool &pool, int from, const uint8_t *source, uint64_t readOffset,
+               int to, uint64_t writeOffset, uint64_t length, function<void ()> done) {
+	if(length == 0) {
+		if(done) done();
+		return;
+	}
+
+	unsigned *remaining = new unsigned((length + chunkSize - 1) / chunkSize);
+	auto finished = [=]() {
+		if(--*remaining) return;
+		delete remaining;
+		if(done) done();
+	};
+
+	for(uint64_t position = 0; position < length; position += chunkSize) {
+		unsigned size = min((uint64_t)chunkSize, length - position);
+		uint64_t target = writeOffset + position;
+
+		if(source) {
+			engine.write(to, target, source + position, size, [=](bool) { finished(); });
+			continue;
+		}
+
+		// Every buffer in use belongs to a transfer in flight, so one
+		// frees up as soon as any of them completes.
+		uint8_t *buffer = pool.acquire();
+		while(!buffer && engine.waitany()) buffer = pool.acquire();
+		engine.read(from, readOffset + position, buffer, size, [=, &engine, &pool](bool ok) {
+			if(!ok) {
+				pool.release(buffer);
+				return finished();
+			}
+			engine.write(to, target, buffer, size, [=, &pool](bool) {
+				pool.release(buffer);
+				finished();
+			});
+		});
+	}
+}
+
+// Directories are created up front, unless a filter may leave them empty;
+// then each is created along with the first file written into it.
+bool extractDir(gamecube::fst &fs, unsigned dir, string target, uint8_t *buffer) {
+	bool created = !filtering();
+	if(created) directory::create(target);
+
+	for(unsigned n = dir + 1, end = fs.at(dir).next; n < end; n = fs.at(n).next) {
+		if(fs.at(n).directory) {
+			if(!extractDir(fs, n, {target, "/", fs.name(n)}, buffer)) return false;
+			continue;
+		}
+
+		gamecube::fst::dataref data = fs.data(n);
+		if(!selectFile(fs, n, data.off, data.len))
+			continue;
+		if(!created) created = true, directory::create(target);
+
+		uint64_t size = data.len;
+		int image = data.strm->handle();
+		if(image >= 0) {
+			file output;
+			if(output.open({target, "/", fs.name(n)}, file::mode::write)
+			&& output.copy(0, image, data.off, size) == size)
+				continue;
+		}
+
+		// Anything else is moved through the one buffer given.
+		std::unique_ptr<stream> output(openFile({target, "/", fs.name(n)}, file::mode::write));
+		if(output->handle() < 0
+		|| !gamecube::copyStream(data.strm, data.off, size, output.get(), buffer, chunkSize))
+			return false;
+	}
+
+	return true;
+}
+
+// Same as extractDir, but queues every file on the async engine instead of
+// copying them one after another. Output files are closed as they complete.
+bool queueExtract(aio &engine, bufferpool &pool, gamecube::fst &fs, unsigned dir, string target) {
+	bool created = !filtering();
+	if(created) directory::create(target);
+
+	for(unsigned n = dir + 1, end = fs.at(dir).next; n < end; n = fs.at(n).next) {
+		if(fs.at(n).directory) {
+			if(!queueExtract(engine, pool, fs, n, {target, "/", fs.name(n)})) return false;
+			continue;
+		}
+
+		gamecube::fst::entry node = fs.at(n);
+		if(!selectFile(fs, n, node.offset, node.length))
+			continue;
+		if(!created) created = true, directory::create(target);
+
+		stream *image = fs.image;
+		if(!inImage(image, node.offset, node.length))
+			return false;
+
+		file *output = new file;
+		if(!output->open({target, "/", fs.name(n)}, file::mode::write)) {
+			delete output;
+			return false;
+		}
+
+		// Whatever the kernel can copy by itself doesn't need queueing.
+		uint64_t copied = output->copy(0, image->handle(), node.offset, node.length);
+		const uint8_t *source = image->data() ? image->data() + node.offset + copied : nullptr;
+		queueCopy(engine, pool, image->handle(), source, node.offset + copied, output->handle(), copied,
+		          node.length - copied, [=]() { delete output; });
+	}
+
+	return true;
+}
+
+// Maps the image when possible, so file data can be borrowed straight out
+// of the page cache; falls back to plain file access otherwise.
+stream *openImage(string inFile) {
+	mmapstream *image = new mmapstream(inFile, filemap::mode::read);
+	if(image->data()) return image;
+
+	delete image;
+	return openFile(inFile, file::mode::read);
+}
+
+// Writes the boot headers, apploader, DOL and FST of an opened image, as
+// far as the filters select them.
+void dumpSystem(gamecube::gcm &iso, string sys) {
+	auto output = [&](const char *name) -> stream* {
+		if(!selected({"sys/", name})) return nullptr;
+		directory::create(sys);
+		return openFile({sys, "/", name}, file::mode::write);
+	};
+	std::unique_ptr<stream> bootfile(output("boot.bin"));
+	std::unique_ptr<stream> bi2file(output("bi2.bin"));
+	std::unique_ptr<stream> appldrfile(output("apploader.img"));
+	std::unique_ptr<stream> binaryfile(output("main.dol"));
+	std::unique_ptr<stream> fstfile(output("fst.bin"));
+
+	if(bootfile) iso.writeBootHeader(bootfile.get());
+	if(bi2file) iso.writeBi2Header(bi2file.get());
+	if(appldrfile) iso.appldr.write(appldrfile.get());
+	if(binaryfile) iso.binary.write(binaryfile.get());
+	if(fstfile) iso.filesystem.write(fstfile.get(), false);
+}
+
+// A file being pulled out of an image that can only be read front to back.
+struct sweepFile {
+	string path;
+	uint64_t offset, length;
+	file *output;
+};
+
+void collectFiles(gamecube::fst &fs, unsigned dir, string target, vector<sweepFile> &files) {
+	bool created = !filtering();
+	if(created) directory::create(target);
+
+	for(unsigned n = dir + 1, end = fs.at(dir).next; n < end; n = fs.at(n).next) {
+		gamecube::fst::entry node = fs.at(n);
+		if(node.directory) {
+			collectFiles(fs, n, {target, "/", fs.name(n)}, files);
+			continue;
+		}
+
+		if(!selectFile(fs, n, node.offset, node.length))
+			continue;
+		if(!created) created = true, directory::create(target);
+		files.append({{target, "/", fs.name(n)}, node.offset, node.length, nullptr});
+	}
+}
+
+// Extracts every file on jobs threads. All directories are created before
+// any file is written; each file is then one task of a work-stealing pool.
+bool parallelExtract(gamecube::fst &fs, string target) {
+	vector<sweepFile> files;
+	collectFiles(fs, 0, target, files);
+	if(extractOrder == order::disc)
+		sort(files.data(), files.size(), [](const sweepFile &a, const sweepFile &b) {
+			return a.offset < b.offset;
+		});
+	if(extractOrder == order::size)
+		sort(files.data(), files.size(), [](const sweepFile &a, const sweepFile &b) {
+			return a.length > b.length;
+		});
+
+	stream *image = fs.image;
+	vector<uint8_t*> buffers;
+	for(unsigned n = 0; n < jobs; n++) buffers.append(nullptr);
+	std::atomic<bool> failed(false);
+
+	workpool::run(files.size(), jobs, [&](unsigned task, unsigned thread) {
+		const sweepFile &f = files[task];
+		file output;
+		if(!inImage(image, f.offset, f.length) || !output.open(f.path, file::mode::write))
+			return (void)(failed = true);
+
+		uint64_t copied = image->handle() < 0 ? 0 : output.copy(0, image->handle(), f.offset, f.length);
+		if(copied < f.length && image->data()) {
+			for(uint64_t position = copied; position < f.length; position += threadBuffer) {
+				unsigned size = min((uint64_t)threadBuffer, f.length - position);
+				if(output.pwrite(position, image->data() + f.offset + position, size) != size)
+					return (void)(failed = true);
+			}
+			return;
+		}
+
+		uint8_t *&buffer = buffers[thread];
+		for(uint64_t position = copied; position < f.length; position += threadBuffer) {
+			if(!buffer) buffer = new uint8_t[threadBuffer];
+			unsigned size = min((uint64_t)threadBuffer, f.length - position);
+			if(image->readAt(f.offset + position, buffer, size) != size
+			|| output.pwrite(position, buffer, size) != size)
+				return (void)(failed = true);
+		}
+	});
+
+	for(auto buffer : buffers)
+		delete[] buffer;
+	return !failed;
+}
+
+// Extracts every file by reading the image once, front to back, from
+// position on. Files are started in disc order and fed from the same large
+// reads; gaps between them are skipped. The first position bytes of the
+// image are taken from prefix instead, if given.
+bool sweepExtract(gamecube::fst &fs, string target, stream *input, const uint8_t *prefix, uint64_t position) {
+	uint64_t prefixSize = prefix ? position : 0;
+	vector<sweepFile> files;
+	collectFiles(fs, 0, target, files);
+	sort(files.data(), files.size(), [](const sweepFile &a, const sweepFile &b) {
+		return a.offset < b.offset;
+	});
+
+	uint8_t *buffer = new uint8_t[chunkSize];
+	bool ok = true;
+	for(unsigned first = 0, next = 0; ok && first < files.size();) {
+		// Start every file whose data begins by now; whatever part of it
+		// is already in memory is written straight away.
+		while(ok && next < files.size() && files[next].offset <= position) {
+			sweepFile &f = files[next++];
+			f.output = new file;
+			ok = f.output->open(f.path, file::mode::write);
+			if(ok && f.offset < prefixSize)
+				f.output->write(prefix + f.offset, min(f.offset + f.length, prefixSize) - f.offset);
+		}
+
+		uint64_t last = position;
+		for(unsigned n = first; n < next; n++) {
+			if(files[n].output && files[n].offset + files[n].length <= position) {
+				delete files[n].output;
+				files[n].output = nullptr;
+			}
+			last = max(last, files[n].offset + files[n].length);
+		}
+		while(first < next && !files[first].output) first++;
+		if(!ok || first == files.size()) break;
+
+		// Nothing in progress: skip ahead to where the next file starts.
+		if(first == next) {
+			input->seek(position = files[next].offset);
+			ok = input->size() >= position;
+			continue;
+		}
+
+		uint64_t end = min(position + chunkSize, last);
+		if(next < files.size()) end = min(end, files[next].offset);
+		input->read(buffer, end - position);
+		ok = input->size() >= end;
+
+		for(unsigned n = first; n < next; n++) {
+			sweepFile &f = files[n];
+			uint64_t lo = max(f.offset, position), hi = min(f.offset + f.length, end);
+			if(f.output && hi > lo) f.output->write(buffer + (lo - position), hi - lo);
+		}
+		position = end;
+	}
+
+	for(auto &f : files)
+		if(f.output) delete f.output;
+	delete[] buffer;
+
+	return ok;
+}
+
+// Unpacks from a stream that can only be read front to back, such as a pipe.
+// Everything up to the end of the DOL and FST is held in memory and opened
+// as usual. The remaining files are then swept out in disc order, so
+// nothing past the metadata is held in memory.
+bool unpackSequential(stream *input, string outDir) {
+	// Offsets come from the headers being read, so the buffer only grows as
+	// bytes actually arrive, and never past what metadata could need.
+	const uint64_t prefixLimit = 256 * 1024 * 1024;
+	uint8_t *prefix = nullptr;
+	uint64_t prefixSize = 0, prefixCapacity = 0;
+	auto need = [&](uint64_t end) -> bool {
+		if(end > prefixLimit)
+			return false;
+		while(prefixSize < end) {
+			unsigned chunk = min((uint64_t)chunkSize, end - prefixSize);
+			if(prefixSize + chunk > prefixCapacity) {
+				uint64_t capacity = min(max(prefixCapacity * 2, prefixSize + chunk), prefixLimit);
+				uint8_t *grown = (uint8_t*)realloc(prefix, capacity);
+				if(!grown)
+					return false;
+				prefix = grown, prefixCapacity = capacity;
+			}
+			input->read(prefix + prefixSize, chunk);
+			if(input->size() < prefixSize + chunk)
+				return false;
+			prefixSize += chunk;
+		}
+		return true;
+	};
+
+	// Each structure's extent is only known once its own header has arrived.
+	gamecube::gcm::Header header;
+	gamecube::apploader::Header loader;
+	gamecube::dol::Header executable;
+	gamecube::fst::RawEntry rootEntry, entry;
+	bool ok = need(0x2460);
+	if(ok) {
+		gamecube::layout::decode(header, prefix);
+		gamecube::layout::decode(loader, prefix + 0x2440);
+		ok = need(0x2460ull + loader.length + loader.trailer)
+		  && need((uint64_t)header.dolOffset + gamecube::layout::of<gamecube::dol::Header>::size)
+		  && need((uint64_t)header.fstOffset + gamecube::layout::of<gamecube::fst::RawEntry>::size);
+	}
+	if(ok) {
+		gamecube::layout::decode(executable, prefix + header.dolOffset);
+		for(unsigned n = 0; ok && n < gamecube::dol::max_sections; n++)
+			ok = need((uint64_t)header.dolOffset + executable.offset[n] + executable.size[n]);
+
+		gamecube::layout::decode(rootEntry, prefix + header.fstOffset);
+		uint64_t strTable = header.fstOffset + (uint64_t)rootEntry.length * 0xc;
+		uint64_t lastName = strTable;
+		ok = ok && need(strTable);
+		for(unsigned n = 1; ok && n < rootEntry.length; n++) {
+			gamecube::layout::decode(entry, prefix + header.fstOffset + n * 0xc);
+			lastName = max(lastName, strTable + entry.nameOffset);
+		}
+		while(ok && (ok = need(lastName + 1)) && prefix[lastName]) lastName++;
+	}
+
+	gamecube::gcm iso;
+	if(!ok || !iso.open(new memorystream((const uint8_t*)prefix, prefixSize))) {
+		free(prefix);
+		return false;
+	}
+
+	ok = sweepExtract(iso.filesystem, {outDir, "/root"}, input, prefix, prefixSize);
+
+	if(ok) dumpSystem(iso, {outDir, "/sys"});
+	iso.close();
+	free(prefix);
+	return ok;
+}
+
+// What an incremental unpack knows about a file it wrote earlier: the image
+// and extent its data came from, the hash of that data, and the modification
+// time the file was left with.
+struct cacheRecord {
+	string path, image, hash;
+	uint64_t offset, length, mtime;
+};
+
+// Images are told apart by where they are, their size and when they were
+// last changed, so a cached hash is never read out of an image.
+string imageIdentity(string inFile) {
+	string identity = {realpath(inFile), ":", file::size(inFile), ":", (uint64_t)file::timestamp(inFile, file::time::modify)};
+	return substr(sha256((const uint8_t*)(const char*)identity, identity.length()), 0, 16);
+}
+
+// Fails if the extent lies past the end of the image or can't be read in
+// full, rather than hash anything but the file's own bytes.
+bool hashExtent(stream *image, uint64_t offset, uint64_t length, uint8_t *buffer, string &result) {
+	if(!inImage(image, offset, length))
+		return false;
+	sha256_ctx sha;
+	sha256_init(&sha);
+	for(uint64_t position = 0; position < length; position += chunkSize) {
+		unsigned size = min((uint64_t)chunkSize, length - position);
+		if(image->data()) sha256_chunk(&sha, image->data() + offset + position, size);
+		else {
+			if(!buffer || image->readAt(offset + position, buffer, size) != size)
+				return false;
+			sha256_chunk(&sha, buffer, size);
+		}
+	}
+	sha256_final(&sha);
+	uint8_t hash[32];
+	sha256_hash(&sha, hash);
+	result = "";
+	for(auto &byte : hash) result.append(hex<2>(byte));
+	return true;
+}
 
-	for(auto node : root.children) {
-		if(node.children.empty()) {
-			unsigned size = node.data.len;
-			uint8_t *data = new uint8_t[size];
-			node.data.read(data);
+vector<cacheRecord> readCache(string outDir) {
+	vector<cacheRecord> records;
+	string text;
+	if(!text.readfile({outDir, "/", cacheName}))
+		return records;
 
-			file::write({target, "/", node.name}, data, size);
-			delete[] data;
-		} else	extractDir(node, {target, "/", node.name});
+	lstring lines = text.split("\n");
+	for(auto &line : lines) {
+		lstring field = line.split<5>("\t");
+		if(field.size() != 6) continue;
+		records.append({field[5], field[0], field[4], decimal(field[1]), decimal(field[2]), decimal(field[3])});
 	}
+	sort(records.data(), records.size(), [](const cacheRecord &a, const cacheRecord &b) {
+		return strcmp(a.path, b.path) < 0;
+	});
+	return records;
+}
+
+const cacheRecord *findRecord(const vector<cacheRecord> &records, const string &path) {
+	unsigned lo = 0, hi = records.size();
+	while(lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		int order = strcmp(records[mid].path, path);
+		if(order == 0) return &records[mid];
+		if(order < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return nullptr;
+}
+
+// A file unpack is about to look at, with what is known about it.
+struct pendingFile {
+	unsigned index;
+	string path;
+	uint64_t offset, length;
+	const cacheRecord *record;
+	bool onDisk;
+	string hash;
+};
+
+// Works out which files on disk already match the image, filling in
+// unchanged. A file on disk is known to hold the data it was written with
+// if its size and modification time are as recorded. That data is known to
+// match the image if it came from the same extent of the same image;
+// otherwise the extent is hashed, on several threads, and compared.
+// Hashes are also taken of every file about to be written, for the cache.
+// Fails if any of them can't be hashed.
+bool planIncremental(gamecube::fst &fs, string identity, string outDir,
+                     const vector<cacheRecord> &records, vector<pendingFile> &files) {
+	for(unsigned n = 0; n < fs.fileCount(); n++) unchanged.append(false);
+
+	for(unsigned n = 1; n < fs.fileCount(); n++) {
+		gamecube::fst::entry node = fs.at(n);
+		if(node.directory || !selectFile(fs, n, node.offset, node.length))
+			continue;
+
+		string path = fs.path(n), target = {outDir, "/root/", path};
+		const cacheRecord *r = findRecord(records, path);
+		bool onDisk = r && r->length == node.length && file::exists(target)
+		           && file::size(target) == node.length
+		           && (uint64_t)file::timestamp(target, file::time::modify) == r->mtime;
+		bool sameSource = r && r->image == identity && r->offset == node.offset;
+		files.append({n, path, node.offset, node.length, r, onDisk, sameSource ? r->hash : string{""}});
+	}
+
+	vector<unsigned> hashing;
+	for(unsigned n = 0; n < files.size(); n++)
+		if(files[n].hash.empty()) hashing.append(n);
+
+	stream *image = fs.image;
+	unsigned threads = image->positional() ? max(1u, jobs ? jobs : std::thread::hardware_concurrency()) : 1;
+	bufferpool pool(threads, chunkSize);
+	vector<uint8_t*> buffers;
+	for(unsigned n = 0; n < threads; n++) buffers.append(pool.acquire());
+	std::atomic<bool> failed(false);
+	workpool::run(hashing.size(), threads, [&](unsigned task, unsigned thread) {
+		pendingFile &f = files[hashing[task]];
+		if(!hashExtent(image, f.offset, f.length, buffers[thread], f.hash))
+			failed = true;
+	});
+	if(failed)
+		return false;
+
+	for(auto &f : files)
+		if(f.onDisk && f.hash == f.record->hash) unchanged[f.index] = true;
+	return true;
+}
+
+// Deletes what an earlier unpack wrote for files the image no longer has,
+// along with directories that leaves empty, so the tree ends up as a clean
+// unpack would. Files changed since they were written are left alone.
+void pruneRemoved(gamecube::fst &fs, string outDir, const vector<cacheRecord> &records) {
+	for(auto &r : records) {
+		if(fs.find(r.path))
+			continue;
+		string target = {outDir, "/root/", r.path};
+		if(!file::exists(target) || file::size(target) != r.length
+		|| (uint64_t)file::timestamp(target, file::time::modify) != r.mtime
+		|| !file::remove(target))
+			continue;
+
+		string parent = r.path;
+		for(signed i = parent.length() - 1; i > 0; i--) {
+			if(parent[i] != '/') continue;
+			parent[i] = 0;
+			string folder = {outDir, "/root/", parent};
+			if(fs.find(parent) || directory::contents(folder).size() || !directory::remove(folder))
+				break;
+		}
+	}
+}
+
+// Records every file this unpack wrote or found up to date. Records of
+// files that were filtered out are kept, as long as the image still has them.
+void writeCache(gamecube::fst &fs, string identity, string outDir,
+                const vector<cacheRecord> &records, const vector<pendingFile> &files) {
+	vector<bool> seen;
+	for(unsigned n = 0; n < records.size(); n++) seen.append(false);
+	string text;
+	for(auto &f : files) {
+		if(f.record) seen[f.record - records.data()] = true;
+		string target = {outDir, "/root/", f.path};
+		text.append(identity, "\t", f.offset, "\t", f.length, "\t",
+		            (uint64_t)file::timestamp(target, file::time::modify), "\t", f.hash, "\t", f.path, "\n");
+	}
+	for(unsigned n = 0; n < records.size(); n++) {
+		const cacheRecord &r = records[n];
+		if(seen[n] || !fs.find(r.path)) continue;
+		text.append(r.image, "\t", r.offset, "\t", r.length, "\t", r.mtime, "\t", r.hash, "\t", r.path, "\n");
+	}
+	file::write({outDir, "/", cacheName}, (const uint8_t*)(const char*)text, text.length());
 }
 
 bool unpack(string inFile, string outDir) {
+	if(inFile == "-") {
+		pipestream input;
+		return unpackSequential(&input, outDir);
+	}
+
 	gamecube::gcm iso;
 	string root = {outDir, "/root"};
 	string sys = {outDir, "/sys"};
 
-	if(!iso.open(new filestream(inFile)))
+	stream *image = sweepImage ? openFile(inFile, file::mode::read) : openImage(inFile);
+	if(!iso.open(image))
 		return false;
 
-	extractDir(iso.filesystem.root, root);
-
-	directory::create(sys);
-	filestream bootfile({sys, "/boot.bin"}, file::mode::write);
-	filestream bi2file({sys, "/bi2.bin"}, file::mode::write);
-	filestream appldrfile({sys, "/apploader.img"}, file::mode::write);
-	filestream binaryfile({sys, "/main.dol"}, file::mode::write);
-	filestream fstfile({sys, "/fst.bin"}, file::mode::write);
+	string identity;
+	vector<cacheRecord> records;
+	vector<pendingFile> files;
+	unchanged.reset();
+	if(incremental) {
+		identity = imageIdentity(inFile);
+		records = readCache(outDir);
+		if(!planIncremental(iso.filesystem, identity, outDir, records, files))
+			return false;
+	}
 
-	iso.writeBootHeader(&bootfile);
-	iso.writeBi2Header(&bi2file);
-	iso.appldr.write(&appldrfile);
-	iso.binary.write(&binaryfile);
-	iso.filesystem.write(&fstfile, false);
+	if(sweepImage) {
+		if(!sweepExtract(iso.filesystem, root, image, nullptr, 0))
+			return false;
+	} else if(jobs > 1 && image->positional()) {
+		if(!parallelExtract(iso.filesystem, root))
+			return false;
+	} else if(queueDepth && (image->data() || image->handle() >= 0)) {
+		// One buffer per transfer in flight, reused for every chunk.
+		bufferpool pool(queueDepth, chunkSize);
+		aio engine(queueDepth);
+		bool queued = pool.count() && queueExtract(engine, pool, iso.filesystem, 0, root);
+		engine.wait();
+		if(!queued || engine.failed())
+			return false;
+	} else {
+		bufferpool pool(1, chunkSize);
+		if(!extractDir(iso.filesystem, 0, root, pool.acquire()))
+			return false;
+	}
 
+	dumpSystem(iso, sys);
+	if(incremental) {
+		pruneRemoved(iso.filesystem, outDir, records);
+		writeCache(iso.filesystem, identity, outDir, records, files);
+	}
 	return true;
 }
 
-void archiveDir(gamecube::fst::entry &root, string source, string subdir="") {
+void archiveDir(gamecube::fst &fs, unsigned dir, string source, string subdir="") {
 	lstring files = directory::files({source, subdir});
 	lstring folders = directory::folders({source, subdir});
 
-	for(auto &name : files) {
-		gamecube::fst::entry file;
-		file.name = name;
-		file.data = gamecube::fst::dataref({source, subdir, "/", name});
-		root.children.append(file);
-	}
+	for(auto &name : files)
+		fs.addFile(dir, name, string{source, subdir, "/", name});
 
 	for(auto &name : folders) {
-		gamecube::fst::entry dir;
-		dir.name = name.rtrim("/");
-		archiveDir(dir, source, {subdir, "/", name});
+		unsigned child = fs.addDirectory(dir, name.rtrim("/"));
+		archiveDir(fs, child, source, {subdir, "/", name});
+	}
+}
 
-		root.children.append(dir);
+// Whether a trace line is an offset (decimal, or hex with 0x) or a path.
+bool isOffset(const string &line) {
+	const char *p = line;
+	bool hex = p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+	if(hex) p += 2;
+	if(!*p) return false;
+	for(; *p; p++) {
+		if(*p >= '0' && *p <= '9') continue;
+		if(hex && ((*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F'))) continue;
+		return false;
 	}
+	return true;
+}
+
+// Has the files named in the read trace placed first, in the order they
+// were first read. Entries that match no file are skipped.
+bool applyTrace(gamecube::fst &fs) {
+	string text;
+	if(!text.readfile(traceFile))
+		return print("Error: could not read trace ", traceFile, "\n"), false;
+
+	// Offsets are resolved against the traced image's files, sorted by
+	// where their data lies.
+	struct extent {
+		uint64_t offset, length;
+		unsigned index;
+	};
+	vector<extent> extents;
+	gamecube::gcm traced;
+	if(!traceImage.empty()) {
+		if(!traced.open(openImage(traceImage)))
+			return print("Error: could not open ", traceImage, "\n"), false;
+		gamecube::fst &tfs = traced.filesystem;
+		for(unsigned n = 1; n < tfs.fileCount(); n++) {
+			gamecube::fst::entry e = tfs.at(n);
+			if(!e.directory && e.length) extents.append({e.offset, e.length, n});
+		}
+		sort(extents.data(), extents.size(), [](const extent &a, const extent &b) {
+			return a.offset < b.offset;
+		});
+	}
+
+	lstring lines = text.split("\n");
+	for(auto &line : lines) {
+		line.trim(" \t\r");
+		if(line.empty() || line[0] == '#')
+			continue;
+
+		string path = line;
+		if(isOffset(line)) {
+			if(traceImage.empty())
+				return print("Error: trace has offsets, but no --trace-image\n"), false;
+			uint64_t offset = line.beginswith("0x") || line.beginswith("0X") ? hex(line) : decimal(line);
+			unsigned lo = 0, hi = extents.size();
+			while(lo < hi) {
+				unsigned mid = (lo + hi) / 2;
+				if(extents[mid].offset <= offset) lo = mid + 1;
+				else hi = mid;
+			}
+			if(lo == 0 || offset >= extents[lo - 1].offset + extents[lo - 1].length)
+				continue;
+			path = traced.filesystem.path(extents[lo - 1].index);
+		}
+
+		auto index = fs.find(path);
+		if(index) fs.placeFirst.append(index.value);
+	}
+	return true;
 }
 
 bool repack(string inDir, string outFile) {
@@ -91,20 +787,184 @@ bool repack(string inDir, string outFile) {
 	string root = {inDir, "/root"};
 	string sys = {inDir, "/sys"};
 
-	archiveDir(iso.filesystem.root, root);
+	archiveDir(iso.filesystem, 0, root);
+	iso.filesystem.policy = packing;
+	if(!traceFile.empty() && !applyTrace(iso.filesystem))
+		return false;
+
+	std::unique_ptr<stream> bootfile(openFile({sys, "/boot.bin"}, file::mode::read));
+	iso.readBootHeader(bootfile.get());
+	std::unique_ptr<stream> bi2file(openFile({sys, "/bi2.bin"}, file::mode::read));
+	iso.readBi2Header(bi2file.get());
+	std::unique_ptr<stream> appldrfile(openFile({sys, "/apploader.img"}, file::mode::read));
+	iso.appldr.read(appldrfile.get());
+	std::unique_ptr<stream> binaryfile(openFile({sys, "/main.dol"}, file::mode::read));
+	iso.binary.read(binaryfile.get());
+
+	std::unique_ptr<stream> isofile(directIO
+		? new directstream(outFile, file::mode::write)
+		: openFile(outFile, file::mode::write));
+
+	// Lay out the image first, collecting where each file goes, then copy
+	// all file data in at once. Host paths stay in the FST's string pool.
+	struct extent {
+		const char *filename;
+		uint64_t offset, length, target;
+	};
+	vector<extent> extents;
+	gamecube::fst &fs = iso.filesystem;
+	fs.onPayload = [&](unsigned index, uint64_t offset) {
+		gamecube::fst::entry node = fs.at(index);
+		extents.append({fs.source(index), node.offset, node.length, offset});
+	};
+	if(!iso.write(isofile.get()))
+		return false;
+
+	int output = isofile->handle();
+	if(!queueDepth || output < 0) {
+		// Files go in one after another in disc order, so the image
+		// stream sees one long sequential write.
+		uint8_t *buffer = new uint8_t[chunkSize];
+		bool ok = true;
+		for(auto &e : extents) {
+			file input;
+			ok = input.open(e.filename, file::mode::read);
+			uint64_t copied = ok ? isofile->copyAt(e.target, input.handle(), e.offset, e.length) : 0;
+			for(uint64_t position = copied; ok && position < e.length; position += chunkSize) {
+				unsigned size = min((uint64_t)chunkSize, e.length - position);
+				ok = input.pread(e.offset + position, buffer, size) == size
+				  && isofile->writeAt(e.target + position, buffer, size) == size;
+			}
+			if(!ok) break;
+		}
+		delete[] buffer;
+		return ok;
+	}
+
+	bufferpool pool(queueDepth, chunkSize);
+	if(!pool.count())
+		return false;
+	aio engine(queueDepth);
+	for(auto &e : extents) {
+		file *input = new file;
+		if(!input->open(e.filename, file::mode::read)) {
+			delete input;
+			engine.wait();
+			return false;
+		}
+		uint64_t copied = file::copy(input->handle(), e.offset, output, e.target, e.length);
+		queueCopy(engine, pool, input->handle(), nullptr, e.offset + copied, output, e.target + copied,
+		          e.length - copied, [=]() { delete input; });
+	}
+	engine.wait();
+	return !engine.failed();
+}
+
+// A file of an image, as far as diff is concerned.
+struct diffFile {
+	string path;
+	uint64_t offset, length;
+};
+
+void listFiles(gamecube::fst &fs, unsigned dir, string prefix, vector<diffFile> &files) {
+	for(unsigned n = dir + 1, end = fs.at(dir).next; n < end; n = fs.at(n).next) {
+		gamecube::fst::entry node = fs.at(n);
+		if(!node.directory)
+			files.append({{prefix, "/", fs.name(n)}, node.offset, node.length});
+		else	listFiles(fs, n, {prefix, "/", fs.name(n)}, files);
+	}
+}
+
+// Whether two extents hold the same bytes. Mapped images are compared in
+// place; anything else is read a chunk at a time into the given buffers.
+bool sameData(stream *a, uint64_t aOffset, stream *b, uint64_t bOffset, uint64_t length,
+              uint8_t *aBuffer, uint8_t *bBuffer) {
+	if(aOffset + length > a->size() || bOffset + length > b->size())
+		return false;
+	if(a->data() && b->data())
+		return memcmp(a->data() + aOffset, b->data() + bOffset, length) == 0;
+
+	for(uint64_t position = 0; position < length; position += chunkSize) {
+		unsigned size = min((uint64_t)chunkSize, length - position);
+		if(a->readAt(aOffset + position, aBuffer, size) != size
+		|| b->readAt(bOffset + position, bBuffer, size) != size
+		|| memcmp(aBuffer, bBuffer, size))
+			return false;
+	}
+	return true;
+}
+
+// Lists the files added (A), deleted (D) and modified (M) between two
+// images. Only the FSTs are read to match files up by path; data is read
+// only for files of the same size, which are compared on several threads.
+bool diff(string aFile, string bFile) {
+	gamecube::gcm a, b;
+	if(!a.open(openImage(aFile), true) || !b.open(openImage(bFile), true))
+		return false;
+
+	vector<diffFile> aFiles, bFiles;
+	listFiles(a.filesystem, 0, "", aFiles);
+	listFiles(b.filesystem, 0, "", bFiles);
+	auto byPath = [](const diffFile &x, const diffFile &y) {
+		return strcmp(x.path, y.path) < 0;
+	};
+	sort(aFiles.data(), aFiles.size(), byPath);
+	sort(bFiles.data(), bFiles.size(), byPath);
+
+	// Files of the same size at the same place in the same image are the
+	// same; every other pair of equal size has to be compared.
+	struct change {
+		const char *kind;
+		const diffFile *a, *b;
+	};
+	vector<change> changes;
+	vector<unsigned> candidates;
+	bool sameImage = realpath(aFile) == realpath(bFile);
+	for(unsigned x = 0, y = 0; x < aFiles.size() || y < bFiles.size();) {
+		int order = x == aFiles.size() ? 1 : y == bFiles.size() ? -1 : strcmp(aFiles[x].path, bFiles[y].path);
+		if(order < 0) { changes.append({"D", &aFiles[x++], nullptr}); continue; }
+		if(order > 0) { changes.append({"A", nullptr, &bFiles[y++]}); continue; }
 
-	filestream bootfile({sys, "/boot.bin"}, file::mode::read);
-	iso.readBootHeader(&bootfile);
-	filestream bi2file({sys, "/bi2.bin"}, file::mode::read);
-	iso.readBi2Header(&bi2file);
-	filestream appldrfile({sys, "/apploader.img"}, file::mode::read);
-	iso.appldr.read(&appldrfile);
-	filestream binaryfile({sys, "/main.dol"}, file::mode::read);
-	iso.binary.read(&binaryfile);
+		const diffFile &from = aFiles[x++], &to = bFiles[y++];
+		if(from.length != to.length)
+			changes.append({"M", &from, &to});
+		else if(from.length && !(sameImage && from.offset == to.offset)) {
+			candidates.append(changes.size());
+			changes.append({"=", &from, &to});
+		}
+	}
 
-	filestream isofile(outFile, file::mode::write);
-	iso.write(&isofile);
+	// Largest files go first, so no thread is left with one big file at the end.
+	sort(candidates.data(), candidates.size(), [&](unsigned x, unsigned y) {
+		return changes[x].a->length > changes[y].a->length;
+	});
+	stream *aImage = a.filesystem.image, *bImage = b.filesystem.image;
+	bool shared = aImage->positional() && bImage->positional();
+	unsigned threads = shared ? max(1u, std::thread::hardware_concurrency()) : 1;
+	threads = min(threads, candidates.size());
+	if(gamecube::memoryBudget() && !(aImage->data() && bImage->data()))
+		threads = min(threads, max(1ull, gamecube::memoryBudget() / (2 * chunkSize)));
+	std::atomic<unsigned> next(0);
+	auto compare = [&]() {
+		uint8_t *aBuffer = new uint8_t[chunkSize], *bBuffer = new uint8_t[chunkSize];
+		for(unsigned n; (n = next++) < candidates.size();) {
+			change &c = changes[candidates[n]];
+			if(!sameData(aImage, c.a->offset, bImage, c.b->offset, c.a->length, aBuffer, bBuffer))
+				c.kind = "M";
+		}
+		delete[] aBuffer;
+		delete[] bBuffer;
+	};
+	vector<std::thread*> workers;
+	for(unsigned n = 1; n < threads; n++) workers.append(new std::thread(compare));
+	compare();
+	for(auto &worker : workers) {
+		worker->join();
+		delete worker;
+	}
 
+	for(auto &c : changes)
+		if(c.kind[0] != '=') print(c.kind, " ", (c.a ? c.a : c.b)->path, "\n");
 	return true;
 }
 
@@ -188,11 +1048,35 @@ int usage() {
 	print("\n");
 	print("Usage:\n");
 	print("  gcm-tool                             # For GUI mode.\n");
-	print("  gcm-tool <action> <input> <output>\n");
+	print("  gcm-tool [options] <action> <input> <output>\n");
 	print("\n");
 	print("actions:\n");
-	print("  unpack <in gcm file> <out directory>\n");
+	print("  unpack <in gcm file> <out directory>   (- reads the image from stdin)\n");
 	print("  repack <in directory> <out gcm file>\n");
+	print("  diff <old gcm file> <new gcm file>     lists added, deleted and modified files\n");
+	print("\n");
+	print("options:\n");
+	print("  --block-size=<bytes>   buffer size for file access (0 = unbuffered)\n");
+	print("  --queue-depth=<n>      file transfers kept in flight (0 = synchronous)\n");
+	print("  --direct               write images around the page cache\n");
+	print("  --include=<glob>       unpack only matching files, such as *.dol or audio/*\n");
+	print("  --exclude=<glob>       leave matching files out of an unpack\n");
+	print("  --range=<start>[:<n>]  unpack only n bytes of each file, from start\n");
+	print("  --incremental          only rewrite files that differ from the image, and\n");
+	print("                         delete those an earlier unpack wrote that it lacks\n");
+	print("  --sweep                unpack by reading the image once, front to back\n");
+	print("  -j <n>                 unpack on n threads\n");
+	print("  --thread-buffer=<bytes> buffer each unpack thread copies through\n");
+	print("  --order=<order>        order unpack threads take files in: disc\n");
+	print("                         (default), tree or size (largest first)\n");
+	print("  --memory=<bytes>       keep data buffers within this many bytes, copying\n");
+	print("                         large files and executables in pieces\n");
+	print("  --align=[<.ext>:]<n>   align file data to n bytes, for one extension or\n");
+	print("                         all others (power of two, at least 4; default 4096)\n");
+	print("  --pack=<bytes>         pack files smaller than this into alignment padding\n");
+	print("  --trace=<file>         place files in the order of a read trace: a path\n");
+	print("                         or an image offset per line, in access order\n");
+	print("  --trace-image=<gcm>    image the offsets in a trace refer to\n");
 	print("\n");
 
 	return 0;
@@ -207,13 +1091,113 @@ int main(int argc, char **argv) {
 	               !strcmp(argv[1], "-h")))
 		return usage();
 
-	if(argc == 4) {
-		if(!strcmp(argv[1], "unpack")) {
-			if(!unpack(argv[2], argv[3]))
-				return print("Error: could not unpack ", argv[2], "\n"), 2;
-		} else if(!strcmp(argv[1], "repack")) {
-			if(!repack(argv[2], argv[3]))
-				return print("Error: could not repack from", argv[2], "\n"), 3;
+	lstring args;
+	for(int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if(arg.beginswith("--block-size=")) {
+			blockSize = decimal(arg.ltrim<1>("--block-size="));
+			continue;
+		}
+		if(arg == "--direct") {
+			directIO = true;
+			continue;
+		}
+		if(arg.beginswith("--queue-depth=")) {
+			queueDepth = decimal(arg.ltrim<1>("--queue-depth="));
+			continue;
+		}
+		if(arg == "--incremental") {
+			incremental = true;
+			continue;
+		}
+		if(arg == "--sweep") {
+			sweepImage = true;
+			continue;
+		}
+		if(arg == "-j" && i + 1 < argc) {
+			jobs = decimal(argv[++i]);
+			continue;
+		}
+		if(arg.beginswith("-j") && arg != "-j") {
+			jobs = decimal(arg.ltrim<1>("-j"));
+			continue;
+		}
+		if(arg.beginswith("--thread-buffer=")) {
+			threadBuffer = max(4096u, (unsigned)decimal(arg.ltrim<1>("--thread-buffer=")));
+			continue;
+		}
+		if(arg.beginswith("--order=")) {
+			string name = arg.ltrim<1>("--order=");
+			if(name == "tree") extractOrder = order::tree;
+			else if(name == "disc") extractOrder = order::disc;
+			else if(name == "size") extractOrder = order::size;
+			else return print("Error: order must be tree, disc or size.\n"), 1;
+			continue;
+		}
+		if(arg.beginswith("--include=")) {
+			includes.append(arg.ltrim<1>("--include="));
+			continue;
+		}
+		if(arg.beginswith("--exclude=")) {
+			excludes.append(arg.ltrim<1>("--exclude="));
+			continue;
+		}
+		if(arg.beginswith("--range=")) {
+			lstring part = arg.ltrim<1>("--range=").split<1>(":");
+			auto number = [](const string &n) -> uint64_t {
+				return n.beginswith("0x") || n.beginswith("0X") ? hex(n) : decimal(n);
+			};
+			rangeStart = number(part[0]);
+			if(part.size() == 2) rangeLength = number(part[1]);
+			continue;
+		}
+		if(arg.beginswith("--memory=")) {
+			gamecube::memoryBudget() = decimal(arg.ltrim<1>("--memory="));
+			continue;
+		}
+		if(arg.beginswith("--align=")) {
+			lstring part = arg.ltrim<1>("--align=").split<1>(":");
+			unsigned alignment = decimal(part[part.size() - 1]);
+			if(alignment < 4 || (alignment & (alignment - 1)))
+				return print("Error: alignment must be a power of two, at least 4.\n"), 1;
+			if(part.size() == 2)
+				packing.rules.append({part[0], alignment});
+			else	packing.alignment = alignment;
+			continue;
+		}
+		if(arg.beginswith("--trace=")) {
+			traceFile = arg.ltrim<1>("--trace=");
+			continue;
+		}
+		if(arg.beginswith("--trace-image=")) {
+			traceImage = arg.ltrim<1>("--trace-image=");
+			continue;
+		}
+		if(arg.beginswith("--pack=")) {
+			packing.packBelow = decimal(arg.ltrim<1>("--pack="));
+			continue;
+		}
+		args.append(arg);
+	}
+
+	// Everything kept in flight at once has to fit under the budget too.
+	if(uint64_t budget = gamecube::memoryBudget()) {
+		chunkSize = gamecube::transferSize(budget / 2);
+		queueDepth = min((uint64_t)queueDepth, budget / chunkSize);
+		blockSize = min((uint64_t)blockSize, budget / 4);
+		threadBuffer = max(4096ull, min((uint64_t)threadBuffer, budget / max(jobs, 1u)));
+	}
+
+	if(args.size() == 3) {
+		if(args[0] == "unpack") {
+			if(!unpack(args[1], args[2]))
+				return print("Error: could not unpack ", args[1], "\n"), 2;
+		} else if(args[0] == "repack") {
+			if(!repack(args[1], args[2]))
+				return print("Error: could not repack from", args[1], "\n"), 3;
+		} else if(args[0] == "diff") {
+			if(!diff(args[1], args[2]))
+				return print("Error: could not compare ", args[1], " and ", args[2], "\n"), 4;
 		} else	return print("Error: invalid action.\n"), 1;
 		return 0;
 	}
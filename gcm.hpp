@@ -24,6 +24,10 @@
  * It can be used pretty efficiently with mmap/memory streams, assuming
  * there's address space to spare.
  *
+ * File data is fetched with positional reads, so several threads can pull
+ * files out of one opened image at once, as long as the stream reports
+ * positional() (file, buffered, mmap and memory streams all do.)
+ *
  * I'm also keeping the junk data in the headers, in case they have any
  * affect on things...
  */
@@ -36,6 +40,59 @@
 
 namespace gamecube {
 
+// Offsets and sizes are 64-bit in memory, but only 32 bits wide on disc (24
+// for FST name offsets), so they are range-checked when written out.
+inline bool fitsOnDisc(uint64_t value, unsigned bytes = 4) {
+    return (value >> (bytes * 8)) == 0;
+}
+
+// Most bytes held in memory at once while moving data between streams, 0
+// for no budget. Under a budget, the DOL and apploader are left on the stream
+// they were read from when they are larger than it (the stream then has to
+// outlive them), and all data is copied in pieces no bigger than it.
+inline uint64_t &memoryBudget() {
+    static uint64_t bytes = 0;
+    return bytes;
+}
+
+// Size of the buffer used to move length bytes between streams.
+inline unsigned transferSize(uint64_t length) {
+    uint64_t size = 1024 * 1024;
+    if(memoryBudget())
+        size = nall::min(size, memoryBudget());
+    return nall::max(nall::min(length, size), 1ull);
+}
+
+// Copies length bytes from offset in one stream to the current offset of
+// another, one transfer at a time. Mapped sources are written from in place;
+// anything else goes through buffer, which holds size bytes, or through a
+// buffer of transferSize() if none is given.
+inline bool copyStream(nall::stream *from, uint64_t offset, uint64_t length, nall::stream *to,
+                       uint8_t *buffer = 0, unsigned size = 0) {
+    if(offset + length > from->size())
+        return false;
+
+    if(from->data()) {
+        size = transferSize(length);
+        for(uint64_t position = 0; position < length; position += size)
+            to->write(from->data() + offset + position, nall::min((uint64_t)size, length - position));
+        return true;
+    }
+
+    uint8_t *owned = 0;
+    if(!buffer || !size)
+        buffer = owned = new uint8_t[size = transferSize(length)];
+    bool ok = true;
+    for(uint64_t position = 0; ok && position < length; position += size) {
+        unsigned chunk = nall::min((uint64_t)size, length - position);
+        ok = from->readAt(offset + position, buffer, chunk) == chunk;
+        if(ok) to->write(buffer, chunk);
+    }
+    delete[] owned;
+    return ok;
+}
+
+#include "gcm/layout.hpp"
 #include "gcm/appldr.hpp"
 #include "gcm/fst.hpp"
 #include "gcm/dol.hpp"
@@ -81,7 +138,8 @@ struct gcm {
     dol binary;
     fst filesystem;
 
-    inline bool open(nall::stream *s);
+    // A lazy open leaves the FST undecoded until it is used; see fst::read.
+    inline bool open(nall::stream *s, bool lazy = false);
     inline bool readBootHeader(nall::stream *s);
     inline bool readBi2Header(nall::stream *s);
     inline bool write(nall::stream *os);
@@ -96,86 +154,87 @@ protected:
     nall::stream *strm;
 };
 
-bool gcm::open(nall::stream *s) {
+namespace layout {
+    template<> struct of<gcm::Header> : record<gcm::Header, 0x440,
+        GCM_FIELD(0x000, gcm::Header, gameCode      ),
+        GCM_FIELD(0x004, gcm::Header, developerId   ),
+        GCM_FIELD(0x006, gcm::Header, diskId        ),
+        GCM_FIELD(0x007, gcm::Header, version       ),
+        GCM_FIELD(0x008, gcm::Header, audioStrm     ),
+        GCM_FIELD(0x009, gcm::Header, strmBufferLen ),
+        GCM_FIELD(0x00a, gcm::Header, reserved1     ),
+        GCM_FIELD(0x01c, gcm::Header, magicWord     ),
+        GCM_FIELD(0x020, gcm::Header, gameName      ),
+        GCM_FIELD(0x400, gcm::Header, dbgMonOffset  ),
+        GCM_FIELD(0x404, gcm::Header, dbgMonBaseAddr),
+        GCM_FIELD(0x408, gcm::Header, reserved2     ),
+        GCM_FIELD(0x420, gcm::Header, dolOffset     ),
+        GCM_FIELD(0x424, gcm::Header, fstOffset     ),
+        GCM_FIELD(0x428, gcm::Header, fstSize       ),
+        GCM_FIELD(0x42c, gcm::Header, fstSizeMax    ),
+        GCM_FIELD(0x430, gcm::Header, unknown1      ),
+        GCM_FIELD(0x434, gcm::Header, unknown2      ),
+        GCM_FIELD(0x438, gcm::Header, unknown3      ),
+        GCM_FIELD(0x43c, gcm::Header, reserved3     )
+    > {};
+
+    template<> struct of<gcm::Info> : record<gcm::Info, 0x2000,
+        GCM_FIELD(0x000, gcm::Info, dbgMonSize      ),
+        GCM_FIELD(0x004, gcm::Info, simulatedMemSize),
+        GCM_FIELD(0x008, gcm::Info, argOffset       ),
+        GCM_FIELD(0x00c, gcm::Info, dbgFlag         ),
+        GCM_FIELD(0x010, gcm::Info, trackLocation   ),
+        GCM_FIELD(0x014, gcm::Info, trackSize       ),
+        GCM_FIELD(0x018, gcm::Info, countryCode     ),
+        GCM_FIELD(0x01c, gcm::Info, unknown1        ),
+        GCM_FIELD(0x020, gcm::Info, unknown2        )
+    > {};
+}
+
+bool gcm::open(nall::stream *s, bool lazy) {
     if(strm)
         delete strm;
+    strm = s;
 
-    if(!s->readable() || !s->seekable())
+    // anything shorter can't even hold the headers and apploader header
+    if(!s->readable() || !s->seekable() || s->size() < 0x2460)
         return false;
 
     // read header
     s->seek(0);
-    readBootHeader(s);
+    if(!readBootHeader(s))
+        return false;
     s->seek(0x440);
-    readBi2Header(s);
+    if(!readBi2Header(s))
+        return false;
 
     // read apploader
     s->seek(0x2440);
-    appldr.read(s);
+    if(!appldr.read(s))
+        return false;
 
     // read dol
     s->seek(header.dolOffset);
-    binary.read(s);
+    if(!binary.read(s))
+        return false;
 
     // read fst
     s->seek(header.fstOffset);
-    filesystem.read(s);
-
-    strm = s;
-
-    return true;
+    return filesystem.read(s, header.fstSize, lazy);
 }
 
 bool gcm::readBootHeader(nall::stream *s) {
-    s->read(header.gameCode   , sizeof header.gameCode   );
-    s->read(header.developerId, sizeof header.developerId);
-
-    header.diskId         = s->read();
-    header.version        = s->read();
-    header.audioStrm      = s->read();
-    header.strmBufferLen  = s->read();
-
-    s->read(header.reserved1, sizeof header.reserved1);
-    s->read(header.magicWord, sizeof header.magicWord);
-    s->read(header.gameName , sizeof header.gameName );
-
-    header.dbgMonOffset   = s->readm(sizeof header.dbgMonOffset  );
-    header.dbgMonBaseAddr = s->readm(sizeof header.dbgMonBaseAddr);
-
-    s->read(header.reserved2, sizeof header.reserved2);
-
-    header.dolOffset      = s->readm(sizeof header.dolOffset     );
-    header.fstOffset      = s->readm(sizeof header.fstOffset     );
-    header.fstSize        = s->readm(sizeof header.fstSize       );
-    header.fstSizeMax     = s->readm(sizeof header.fstSizeMax    );
-    header.unknown1       = s->readm(sizeof header.unknown1      );
-    header.unknown2       = s->readm(sizeof header.unknown2      );
-    header.unknown3       = s->readm(sizeof header.unknown3      );
-    header.reserved3      = s->readm(sizeof header.reserved3     );
-
-    return true;
+    return layout::read(s, header);
 }
 
 bool gcm::readBi2Header(nall::stream *s) {
-    info.dbgMonSize       = s->readm(sizeof info.dbgMonSize      );
-    info.simulatedMemSize = s->readm(sizeof info.simulatedMemSize);
-    info.argOffset        = s->readm(sizeof info.argOffset       );
-    info.dbgFlag          = s->readm(sizeof info.dbgFlag         );
-    info.trackLocation    = s->readm(sizeof info.trackLocation   );
-    info.trackSize        = s->readm(sizeof info.trackSize       );
-    info.countryCode      = s->readm(sizeof info.countryCode     );
-    info.unknown1         = s->readm(sizeof info.unknown1        );
-    s->read(info.unknown2, sizeof info.unknown2);
-
-    return true;
+    return layout::read(s, info);
 }
 
 bool gcm::write(nall::stream *os) {
     if(!os->writable())
         return false;
 
-    os->seek(0);
-    writeBootHeader(os);
     os->seek(0x440);
     writeBi2Header(os);
 
@@ -186,53 +245,33 @@ bool gcm::write(nall::stream *os) {
     binary.write(os);
 
     // If we need to, we can move the FST down.
-    if(os->offset() > header.fstOffset)
-        header.fstOffset = (os->offset() + 0xFFF) & -0x1000;
+    uint64_t fstOffset = header.fstOffset;
+    if(os->offset() > fstOffset)
+        fstOffset = (os->offset() + 0xFFF) & ~0xFFFull;
+    fst::placement plan;
+    if(!fitsOnDisc(fstOffset) || !filesystem.plan(plan, fstOffset))
+        return false;
 
-    os->seek(header.fstOffset);
-    filesystem.write(os);
+    // The boot header goes in last, once the FST's place and size are known.
+    header.fstOffset = fstOffset;
+    header.fstSize = plan.size;
+    header.fstSizeMax = nall::max(header.fstSizeMax, header.fstSize);
+    os->seek(0);
+    writeBootHeader(os);
 
-    return true;
+    return filesystem.write(os, plan);
 }
 
 inline bool gcm::writeBootHeader(nall::stream *os) {
-    os->write(header.gameCode   , sizeof header.gameCode   );
-    os->write(header.developerId, sizeof header.developerId);
-
-    os->writem(header.diskId       , 1);
-    os->writem(header.version      , 1);
-    os->writem(header.audioStrm    , 1);
-    os->writem(header.strmBufferLen, 1);
-
-    os->write(header.reserved1, sizeof header.reserved1);
-    os->write(header.magicWord, sizeof header.magicWord);
-    os->write(header.gameName , sizeof header.gameName );
-
-    os->writem(header.dbgMonOffset  , sizeof header.dbgMonOffset  );
-    os->writem(header.dbgMonBaseAddr, sizeof header.dbgMonBaseAddr);
-
-    os->write(header.reserved2, sizeof header.reserved2);
-
-    os->writem(header.dolOffset , sizeof header.dolOffset );
-    os->writem(header.fstOffset , sizeof header.fstOffset );
-    os->writem(header.fstSize   , sizeof header.fstSize   );
-    os->writem(header.fstSizeMax, sizeof header.fstSizeMax);
-    os->writem(header.unknown1  , sizeof header.unknown1  );
-    os->writem(header.unknown2  , sizeof header.unknown2  );
-    os->writem(header.unknown3  , sizeof header.unknown3  );
-    os->writem(header.reserved3 , sizeof header.reserved3 );
+    layout::write(os, header);
+
+    return true;
 }
 
 inline bool gcm::writeBi2Header(nall::stream *os) {
-    os->writem(info.dbgMonSize      , sizeof info.dbgMonSize      );
-    os->writem(info.simulatedMemSize, sizeof info.simulatedMemSize);
-    os->writem(info.argOffset       , sizeof info.argOffset       );
-    os->writem(info.dbgFlag         , sizeof info.dbgFlag         );
-    os->writem(info.trackLocation   , sizeof info.trackLocation   );
-    os->writem(info.trackSize       , sizeof info.trackSize       );
-    os->writem(info.countryCode     , sizeof info.countryCode     );
-    os->writem(info.unknown1        , sizeof info.unknown1        );
-    os->write(info.unknown2, sizeof info.unknown2);
+    layout::write(os, info);
+
+    return true;
 }
 
 void gcm::close() {
@@ -23,8 +23,9 @@ struct apploader {
         uint8_t padding[4];
     } header;
 
+    // data is 0 when the body was left on source, at sourceOffset.
     uint8_t *data;
-    int size;
+    unsigned size;
 
     inline bool read(nall::stream *strm);
     inline bool write(nall::stream *strm);
@@ -33,43 +34,82 @@ struct apploader {
     inline ~apploader();
 
 protected:
-    inline uint32_t realsize();
+    inline uint64_t realsize();
+
+    nall::stream *source;
+    uint64_t sourceOffset;
 };
 
+namespace layout {
+    template<> struct of<apploader::Header> : record<apploader::Header, 0x20,
+        GCM_FIELD(0x00, apploader::Header, date      ),
+        GCM_FIELD(0x10, apploader::Header, entrypoint),
+        GCM_FIELD(0x14, apploader::Header, length    ),
+        GCM_FIELD(0x18, apploader::Header, trailer   ),
+        GCM_FIELD(0x1c, apploader::Header, padding   )
+    > {};
+}
+
 bool apploader::read(nall::stream *strm) {
     if(!strm->readable())
         return false;
 
-    strm->read(header.date, sizeof header.date);
-    header.entrypoint = strm->readm(sizeof header.entrypoint);
-    header.length     = strm->readm(sizeof header.length    );
-    header.trailer    = strm->readm(sizeof header.trailer   );
-    strm->read(header.padding, sizeof header.padding);
+    if(!layout::read(strm, header))
+        return false;
 
-    size = ((header.length + header.trailer - 1) / 32) * 32;
+    // both lengths come from the disc; the body has to lie within the stream
+    if(!header.length && !header.trailer)
+        return false;
+    uint64_t length = realsize();
+    if(strm->offset() > strm->size() || length > strm->size() - strm->offset())
+        return false;
+    size = length;
 
     if(data) delete[] data;
-    data = new uint8_t[size];
+    data = 0;
+    source = 0;
+
+    if(memoryBudget() && size > memoryBudget()) {
+        source = strm;
+        sourceOffset = strm->offset();
+    } else {
+        const uint8_t *body = strm->view(strm->offset(), size);
+        if(!body)
+            return false;
+        data = new uint8_t[size];
+        memcpy(data, body, size);
+    }
+    strm->seek(strm->offset() + size);
 
-    strm->read(data, size);
+    return true;
 }
 
 bool apploader::write(nall::stream *strm) {
     if(!strm->writable())
         return false;
 
-    strm->write (header.date      , sizeof header.date      );
-    strm->writem(header.entrypoint, sizeof header.entrypoint);
-    strm->writem(header.length    , sizeof header.length    );
-    strm->writem(header.trailer   , sizeof header.trailer   );
-    strm->write (header.padding   , sizeof header.padding   );
+    if(!header.length && !header.trailer)
+        return false;
+    layout::write(strm, header);
 
-    size = ((header.length + header.trailer - 1) / 32) * 32;
+    size = realsize();
+    if(!data)
+        return source && copyStream(source, sourceOffset, size, strm);
     strm->write(data, size);
+
+    return true;
+}
+
+// in 64 bits, so both lengths at their largest don't wrap; the caller
+// rejects an empty apploader first
+uint64_t apploader::realsize() {
+    return (((uint64_t)header.length + header.trailer - 1) / 32) * 32;
 }
 
 apploader::apploader() {
     data = 0;
+    source = 0;
+    sourceOffset = 0;
 }
 
 apploader::~apploader() {
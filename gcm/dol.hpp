@@ -32,40 +32,93 @@ struct dol {
         nall::vector<uint8_t> buffer;
     };
 
+    // The header as stored on disc; read() and write() go through this.
+    struct Header {
+        uint32_t offset[max_sections];
+        uint32_t baseaddr[max_sections];
+        uint32_t size[max_sections];
+        uint32_t bssAddr, bssSize, entrypoint;
+        uint8_t padding[0x1c];
+    };
+
     Section section[max_sections];
 
     uint32_t bssAddr, bssSize, entrypoint;
+    uint8_t padding[0x1c];
 
     inline bool read(nall::stream *strm);
     inline bool write(nall::stream *strm);
 
+    inline dol();
+
 protected:
-    inline static void fillto(nall::stream *strm, int offset);
+    inline static void fillto(nall::stream *strm, uint64_t offset);
+
+    // Set when the sections were too big for the memory budget and were left
+    // on the stream the DOL was read from, starting at sourceOffset.
+    nall::stream *source;
+    uint64_t sourceOffset;
 
     unsigned fstoffset;
     unsigned strtableoffset;
     unsigned currentry;
 };
 
+namespace layout {
+    template<> struct of<dol::Header> : record<dol::Header, 0x100,
+        GCM_FIELD(0x00, dol::Header, offset    ),
+        GCM_FIELD(0x48, dol::Header, baseaddr  ),
+        GCM_FIELD(0x90, dol::Header, size      ),
+        GCM_FIELD(0xd8, dol::Header, bssAddr   ),
+        GCM_FIELD(0xdc, dol::Header, bssSize   ),
+        GCM_FIELD(0xe0, dol::Header, entrypoint),
+        GCM_FIELD(0xe4, dol::Header, padding   )
+    > {};
+}
+
 bool dol::read(nall::stream *strm) {
-    unsigned i = 0, doloffset = strm->offset();
+    unsigned i = 0;
+    uint64_t doloffset = strm->offset();
+    Header h;
 
-    for(i = 0; i < max_sections; ++i)
-        section[i].offset = strm->readm(4);
-    for(i = 0; i < max_sections; ++i)
-        section[i].baseaddr = strm->readm(4);
-    for(i = 0; i < max_sections; ++i)
-        section[i].size = strm->readm(4);
+    if(!layout::read(strm, h))
+        return false;
+    for(i = 0; i < max_sections; ++i) {
+        section[i].offset = h.offset[i];
+        section[i].baseaddr = h.baseaddr[i];
+        section[i].size = h.size[i];
+    }
 
-    bssAddr = strm->readm(4);
-    bssSize = strm->readm(4);
-    entrypoint = strm->readm(4);
+    bssAddr = h.bssAddr;
+    bssSize = h.bssSize;
+    entrypoint = h.entrypoint;
+    memcpy(padding, h.padding, sizeof padding);
+
+    // offsets and sizes come from the disc; every section has to lie
+    // within the stream before anything is allocated for it
+    uint64_t total = 0;
+    for(i = 0; i < max_sections; ++i) {
+        section[i].buffer.reset();
+        if(section[i].offset > 0 && section[i].size > 0
+        && doloffset + section[i].offset + section[i].size > strm->size())
+            return false;
+        total += section[i].size;
+    }
+
+    source = 0;
+    if(memoryBudget() && total > memoryBudget()) {
+        source = strm;
+        sourceOffset = doloffset;
+        return true;
+    }
 
     for(i = 0; i < max_sections; ++i) {
         if(section[i].offset > 0 && section[i].size > 0) {
+            const uint8_t *body = strm->view(doloffset + section[i].offset, section[i].size);
+            if(!body)
+                return false;
             section[i].buffer.reserve(section[i].size);
-            strm->seek(doloffset + section[i].offset);
-            strm->read(section[i].buffer.data(), section[i].size);
+            memcpy(section[i].buffer.data(), body, section[i].size);
         }
     }
 
@@ -73,25 +126,32 @@ bool dol::read(nall::stream *strm) {
 }
 
 bool dol::write(nall::stream *strm) {
-    unsigned i = 0, doloffset = strm->offset(), endoffset = 0;
+    unsigned i = 0;
+    uint64_t doloffset = strm->offset(), endoffset = 0;
 
-    for(i = 0; i < max_sections; ++i)
-        strm->writem(section[i].offset, 4);
-    for(i = 0; i < max_sections; ++i)
-        strm->writem(section[i].baseaddr, 4);
-    for(i = 0; i < max_sections; ++i)
-        strm->writem(section[i].size, 4);
+    Header h;
 
-    strm->writem(bssAddr, 4);
-    strm->writem(bssSize, 4);
-    strm->writem(entrypoint, 4);
+    for(i = 0; i < max_sections; ++i) {
+        h.offset[i] = section[i].offset;
+        h.baseaddr[i] = section[i].baseaddr;
+        h.size[i] = section[i].size;
+    }
+
+    h.bssAddr = bssAddr;
+    h.bssSize = bssSize;
+    h.entrypoint = entrypoint;
+    memcpy(h.padding, padding, sizeof h.padding);
+    layout::write(strm, h);
 
     for(i = 0; i < max_sections; ++i) {
         if(section[i].offset > 0 && section[i].size > 0) {
             fillto(strm, doloffset + section[i].offset);
-            strm->write(section[i].buffer.data(), section[i].size);
+            if(!source)
+                strm->write(section[i].buffer.data(), section[i].size);
+            else if(!copyStream(source, sourceOffset + section[i].offset, section[i].size, strm))
+                return false;
 
-            unsigned end = doloffset + section[i].offset + section[i].size;
+            uint64_t end = doloffset + section[i].offset + section[i].size;
             if(end > endoffset)
                 endoffset = end;
         }
@@ -102,15 +162,17 @@ bool dol::write(nall::stream *strm) {
     return true;
 }
 
-void dol::fillto(nall::stream *strm, int offset)
+dol::dol() {
+    source = 0;
+    sourceOffset = 0;
+}
+
+void dol::fillto(nall::stream *strm, uint64_t offset)
 {
-    int position = strm->offset();
+    uint64_t position = strm->offset();
 
-    while(position < offset) {
-        strm->writem(0, 1);
-        position++;
-    }
+    if(position < offset)
+        strm->zero(position, offset - position);
 
-    if(position > offset)
-        strm->seek(offset);
+    strm->seek(offset);
 }
@@ -32,13 +32,13 @@ struct fst {
         dataref()
         : buffer(0), strm(0), off(0), len(0), type(none) { }
         
-        dataref(uint8_t *b, unsigned o, unsigned l)
+        dataref(uint8_t *b, uint64_t o, uint64_t l)
         : buffer(b), strm(0), off(o), len(l), type(bufref) { }
         
-        dataref(nall::stream *s, unsigned o, unsigned l)
+        dataref(nall::stream *s, uint64_t o, uint64_t l)
         : buffer(0), strm(s), off(o), len(l), type(streamref) { }
         
-        dataref(nall::string fn, unsigned o = 0, unsigned l = 0)
+        dataref(nall::string fn, uint64_t o = 0, uint64_t l = 0)
         : buffer(0), strm(0), filename(fn), off(o), len(l), type(fileref) {
             if(o == 0 && l == 0) {
                 nall::file f;
@@ -58,27 +58,29 @@ struct fst {
         }
 
         bool read(uint8_t *into) {
+            return readAt(0, into, len);
+        }
+
+        // Reads length bytes starting position bytes into the data.
+        bool readAt(uint64_t position, uint8_t *into, unsigned length) {
+            if(position + length > len)
+                return false;
             switch(type) {
             case bufref:
                 if(!buffer) return false;
-                memcpy(into, buffer + off, len);
+                memcpy(into, buffer + off + position, length);
                 break;
             case streamref:
                 if(!strm) return false;
-                unsigned oldoffset;
-                oldoffset = strm->offset();
-                strm->seek(off);
-                strm->read(into, len);
-                strm->seek(oldoffset);
+                if(strm->readAt(off + position, into, length) != length) return false;
                 break;
             case fileref:
             {
                 nall::file f;
                 if(!f.open(filename, nall::file::mode::read))
                     return false;
-                f.seek(off);
-                f.read(into, len);
-                print("Read ", len, " bytes from ", filename, "\n");
+                if(f.pread(off + position, into, length) != length)
+                    return false;
                 break;
             }
             case none:
@@ -86,191 +88,789 @@ struct fst {
             }
             return true;
         }
+
+        // Borrows the referenced bytes without copying them, when the data
+        // lives in memory or in a stream. Valid until the next view on the
+        // same stream; returns 0 for file references.
+        const uint8_t *view() {
+            switch(type) {
+            case bufref:
+                return buffer ? buffer + off : 0;
+            case streamref:
+                return strm ? strm->view(off, len) : 0;
+            default:
+                return 0;
+            }
+        }
         
         uint8_t *buffer;
         nall::stream *strm;
         nall::string filename;
-        unsigned off, len;
+        uint64_t off, len;
         reftype type;
     };
 
-    struct entry {
-        nall::string name;
+    // One 12-byte FST entry, as stored on disc. For directories, offset is
+    // the parent's index and length is the index following the last child.
+    struct RawEntry {
+        uint8_t flags;
+        uint32_t nameOffset;
+        uint32_t offset;
+        uint32_t length;
+    };
 
-        dataref data;
-        nall::vector<entry> children;
+    // One entry of the file table. Entries are kept in on-disc order, so a
+    // directory is directly followed by everything beneath it: its children
+    // start at index + 1, and each child's next leads to the one after it.
+    struct entry {
+        uint32_t name;      // offset of the name in the string pool
+        uint32_t parent;    // index of the enclosing directory; ~0u for
+                            // files of a lazily read table, as the disc
+                            // only records the parents of directories
+        uint32_t next;      // index following this entry and its contents
+        uint32_t source;    // files: host path in the string pool, or ~0u
+                            // if the data lives in the image itself
+        uint64_t offset;    // files: where the data starts in its source
+        uint64_t length;
+        bool directory;
     };
 
-    entry root;
+    // The stream the table was read from, holding the data of every file
+    // that has no host path.
+    nall::stream *image;
+
+    // When set, write() lays out file data but leaves copying it to the
+    // caller: each file is handed over by index along with its disc offset.
+    nall::function<void (unsigned index, uint64_t offset)> onPayload;
+
+    // Entry 0 is the root directory.
+    inline entry at(unsigned index) const;
+    inline const char *name(unsigned index) const;
+    inline dataref data(unsigned index) const;
+    // The entry's full path, as find() takes it; files of a lazily read
+    // table have no known parent, so only their name is given.
+    inline nall::string path(unsigned index) const;
+    // The host path a file added for writing takes its data from, or 0.
+    inline const char *source(unsigned index) const;
+
+    // Entries must be added depth first: parent is either the directory
+    // added last or one of the directories it is nested in.
+    inline unsigned addDirectory(unsigned parent, const char *name);
+    inline unsigned addFile(unsigned parent, const char *name, const char *path);
+
+    // Looks an entry up by its full path ("dir/file"; a leading slash is
+    // optional) or by its name within one directory. As on the console,
+    // names match regardless of ASCII case. The hash index behind this is
+    // built by read(), or on first use after entries have been added.
+    inline nall::optional<unsigned> find(const char *path);
+    inline nall::optional<unsigned> find(unsigned dir, const char *name);
 
     inline unsigned fileCount();
 
-    inline bool read(nall::stream *strm);
+    // size is the FST's size from the disc header, table and names
+    // together; the whole thing is fetched with one read. A lazy read
+    // keeps those bytes (borrowing them from a mapped image) and decodes
+    // entries only as they are asked for, so looking up one path costs in
+    // proportion to its depth rather than to the number of files. Adding
+    // entries or writing the table decodes it in full.
+    inline bool read(nall::stream *strm, uint64_t size = 0, bool lazy = false);
     inline bool write(nall::stream *strm, bool writeData = true);
 
+    // How plan() places file data. Each file starts on a multiple of its
+    // alignment: the one given for its extension, if any, else the default.
+    // All alignments are powers of two; the format needs at least 4, and
+    // 32 KiB keeps files on ECC block boundaries. Files smaller than
+    // packBelow are held back and then packed, at packAlignment, into the
+    // padding the other files left wherever they fit, so tiny files don't
+    // each cost a block.
+    struct packing {
+        struct rule {
+            nall::string extension;
+            unsigned alignment;
+        };
+
+        unsigned alignment;
+        unsigned packBelow;
+        unsigned packAlignment;
+        nall::vector<rule> rules;
+
+        inline unsigned of(const char *name, bool packed = false) const;
+        inline unsigned largest() const;
+
+        packing() : alignment(4096), packBelow(0), packAlignment(32) { }
+    };
+
+    packing policy;
+
+    // Files whose data plan() places ahead of all others, in this order:
+    // typically the order a game first reads them in, so files used
+    // together end up together and the earliest ones near the start.
+    nall::vector<unsigned> placeFirst;
+
+    // Where everything goes when the table is written at fstOffset, worked
+    // out by plan(). write() then produces the table, the names and the
+    // file data front to back from it.
+    struct placement {
+        uint64_t fstOffset;
+        uint64_t size;                      // entries and names together
+        uint64_t dataStart;                 // where file data begins
+        uint64_t dataEnd;
+        nall::vector<uint32_t> nameOffset;  // per entry, in the string table
+        nall::vector<uint64_t> dataOffset;  // per file, from dataStart
+        nall::vector<uint32_t> order;       // files, in the order of their data
+    };
+
+    inline bool plan(placement &p, uint64_t fstOffset);
+    inline bool write(nall::stream *strm, const placement &p, bool writeData = true);
+
     inline fst();
     inline ~fst();
 
+    // Tables can be large; they are moved around, never copied.
+    fst(const fst&) = delete;
+    fst& operator=(const fst&) = delete;
+    fst(fst&&) = default;
+    fst& operator=(fst&&) = default;
+
 protected:
-    inline static nall::string grabFilename(nall::stream *strm, int offset);
-    inline void recursiveRead(nall::stream *strm, fst::entry &node);
-    inline void recursiveWrite(nall::stream *strm, fst::entry &node, unsigned *strOffset, unsigned *dataOffset, bool writeData);
-    inline void recursivePreflight(fst::entry &node, unsigned *fileCount, unsigned *strTableSize = 0);
-
-    unsigned fstOffset;
-    unsigned strTableOffset;
-    unsigned currEntry;
+    // Open addressing; index is the entry's (or string's) index plus one,
+    // 0 when empty.
+    struct slot {
+        uint32_t hash;
+        uint32_t index;
+    };
+
+    // entries[0] is the root directory. Names, and the host paths of files
+    // added for writing, are NUL-terminated strings in one shared pool. A
+    // table read from disc takes its names over as one block; strings added
+    // afterwards are interned, so a name shared by many files is kept once.
+    nall::vector<entry> entries;
+    nall::vector<char> names;
+    nall::vector<slot> internIndex;
+    unsigned interned;
+
+    // The FST bytes behind a lazily read table; entries holds only the root.
+    bool lazy;
+    bool borrowed;                  // the bytes are in image->data()
+    nall::vector<uint8_t> rawTable; // otherwise, a copy of them
+    unsigned rawCount;
+    uint64_t rawSize;
+
+    inline const uint8_t *raw() const;
+    inline bool materialize();
+    inline bool decode(const uint8_t *table, uint64_t length);
+    inline nall::optional<unsigned> findChild(unsigned dir, const char *name, unsigned length);
+
+    inline void clear();
+    inline uint32_t intern(const char *str, unsigned length);
+    inline unsigned append(unsigned parent, const char *name, bool directory);
+    inline bool writePayload(nall::stream *strm, unsigned index, uint64_t offset, uint8_t *&buffer);
+
+    nall::vector<slot> pathIndex;
+    nall::vector<slot> nameIndex;
+    bool indexed;
+
+    inline static uint32_t hash(uint32_t h, const char *str, unsigned length);
+    inline static bool equal(const char *a, const char *b, unsigned length);
+    inline bool matchesPath(unsigned index, const char *path, unsigned length) const;
+    inline void buildIndex();
+
+    uint64_t fstOffset;
+    uint64_t strTableOffset;
 };
 
-// I need a more clever way to do this so it's not so big...
-nall::string fst::grabFilename(nall::stream *strm, int offset) {
-    unsigned oldoffset = strm->offset();
-    char str[256] = {0};
-    char ch = '\0';
+namespace layout {
+    template<> struct of<fst::RawEntry> : record<fst::RawEntry, 0xc,
+        GCM_FIELD(0x0, fst::RawEntry, flags),
+        field<0x1, fst::RawEntry, uint32_t, &fst::RawEntry::nameOffset, 3>,
+        GCM_FIELD(0x4, fst::RawEntry, offset),
+        GCM_FIELD(0x8, fst::RawEntry, length)
+    > {};
+}
 
-    strm->seek(offset);
-    for(int i = 0; i < 256; i++) {
-        ch = strm->read();
-        str[i] = ch;
+void fst::clear() {
+    entries.reset();
+    names.reset();
+    internIndex.reset();
+    interned = 0;
+}
 
-        if(!ch) break;
+uint32_t fst::intern(const char *str, unsigned length) {
+    uint32_t h = hash(2166136261u, str, length);
+    if((interned + 1) * 2 > internIndex.size()) {
+        nall::vector<slot> old = std::move(internIndex);
+        unsigned size = nall::max(old.size() * 2, 64u);
+        internIndex.resize(size);
+        for(auto &o : old) {
+            if(!o.index) continue;
+            unsigned i = o.hash & (size - 1);
+            while(internIndex[i].index) i = (i + 1) & (size - 1);
+            internIndex[i] = o;
+        }
     }
 
-    strm->seek(oldoffset);
-    return nall::string(str);
+    unsigned mask = internIndex.size() - 1;
+    unsigned i = h & mask;
+    for(; internIndex[i].index; i = (i + 1) & mask) {
+        const char *other = names.data() + internIndex[i].index - 1;
+        if(internIndex[i].hash == h && !strncmp(other, str, length) && !other[length])
+            return internIndex[i].index - 1;
+    }
+
+    uint32_t offset = names.size();
+    internIndex[i].hash = h;
+    internIndex[i].index = offset + 1;
+    interned++;
+
+    if(offset + length + 1 > names.capacity())
+        names.reserve(offset + length + 1);
+    for(unsigned n = 0; n < length; n++)
+        names.append(str[n]);
+    names.append(0);
+    return offset;
 }
 
-void fst::recursiveRead(nall::stream *strm, fst::entry &node) {
-    unsigned flags = strm->read();
-    unsigned fnoffset = strm->readm(3);
-    unsigned offset = strm->readm(4);
-    unsigned length = strm->readm(4);
+const uint8_t *fst::raw() const {
+    return borrowed ? image->data() + fstOffset : rawTable.data();
+}
 
-    ++currEntry;
+fst::entry fst::at(unsigned index) const {
+    if(!lazy || index == 0)
+        return entries[index];
+    if(index >= rawCount)
+        throw nall::vector<entry>::exception_out_of_bounds();
+
+    RawEntry raw;
+    layout::decode(raw, this->raw() + index * 0xc);
+    entry e = { raw.nameOffset, ~0u, index + 1, ~0u, 0, 0, raw.flags == 1 };
+    if(e.directory) {
+        e.parent = nall::min(raw.offset, index - 1);
+        e.next = nall::min(nall::max(raw.length, index + 1), rawCount);
+    } else {
+        e.offset = raw.offset;
+        e.length = raw.length;
+    }
+    return e;
+}
+
+const char *fst::name(unsigned index) const {
+    if(!lazy || index == 0)
+        return names.data() + entries[index].name;
+
+    // Checked on every call, as nothing was checked up front.
+    uint64_t offset = (uint64_t)rawCount * 0xc + at(index).name;
+    const char *str = (const char*)raw() + offset;
+    if(offset >= rawSize || !memchr(str, 0, rawSize - offset))
+        return "";
+    return str;
+}
+
+fst::dataref fst::data(unsigned index) const {
+    entry e = at(index);
+    if(e.directory)
+        return dataref();
+    if(e.source != ~0u)
+        return dataref(nall::string(names.data() + e.source), e.offset, e.length);
+    return dataref(image, e.offset, e.length);
+}
 
-    node.name = grabFilename(strm, strTableOffset + fnoffset);
+nall::string fst::path(unsigned index) const {
+    nall::string result = name(index);
+    for(unsigned n = at(index).parent; n && n != ~0u; n = at(n).parent)
+        result = { name(n), "/", result };
+    return result;
+}
 
-    if(flags == 1) {
-        while(currEntry < length) {
-            fst::entry file;
-            recursiveRead(strm, file);
+const char *fst::source(unsigned index) const {
+    entry e = at(index);
+    return e.source != ~0u ? names.data() + e.source : 0;
+}
 
-            node.children.append(file);
+unsigned fst::append(unsigned parent, const char *name, bool directory) {
+    materialize();
+    unsigned index = entries.size();
+    entry e = { intern(name, strlen(name)), parent, index + 1, ~0u, 0, 0, directory };
+    entries.append(e);
+    indexed = false;
+
+    // Every directory up to the root now ends after this entry.
+    for(unsigned n = parent;; n = entries[n].parent) {
+        entries[n].next = index + 1;
+        if(n == 0) break;
+    }
+    return index;
+}
+
+unsigned fst::addDirectory(unsigned parent, const char *name) {
+    return append(parent, name, true);
+}
+
+unsigned fst::addFile(unsigned parent, const char *name, const char *path) {
+    unsigned index = append(parent, name, false);
+    uint32_t source = intern(path, strlen(path));
+    entries[index].source = source;
+    entries[index].length = nall::file::size(path);
+    return index;
+}
+
+// FNV-1a over the case-folded name.
+uint32_t fst::hash(uint32_t h, const char *str, unsigned length) {
+    for(unsigned n = 0; n < length; n++) {
+        char ch = str[n];
+        if(ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+        h = (h ^ (uint8_t)ch) * 16777619u;
+    }
+    return h;
+}
+
+bool fst::equal(const char *a, const char *b, unsigned length) {
+    for(unsigned n = 0; n < length; n++) {
+        char x = a[n], y = b[n];
+        if(x >= 'A' && x <= 'Z') x += 'a' - 'A';
+        if(y >= 'A' && y <= 'Z') y += 'a' - 'A';
+        if(x != y) return false;
+    }
+    return true;
+}
+
+// Walks from the entry up to the root, matching the path from its end.
+bool fst::matchesPath(unsigned index, const char *path, unsigned length) const {
+    while(index != 0) {
+        unsigned nameLength = strlen(name(index));
+        if(nameLength > length || !equal(path + length - nameLength, name(index), nameLength))
+            return false;
+        length -= nameLength;
+
+        index = entries[index].parent;
+        if(index != 0) {
+            if(length == 0 || path[length - 1] != '/')
+                return false;
+            length--;
         }
-    } else {
-        node.data = fst::dataref(strm, offset, length);
     }
+    return length == 0;
 }
 
-void fst::recursiveWrite(nall::stream *strm, fst::entry &node, unsigned *strOffset, unsigned *dataOffset, bool writeData) {
-    bool isDir = node.children.size() > 0;
-    unsigned totalChildren = 0;
-    recursivePreflight(node, &totalChildren);
-
-    strm->writem(isDir ? 1 : 0, 1);
-    strm->writem(*strOffset - strTableOffset, 3);
-    *dataOffset = (*dataOffset + (4096 - 1)) & -4096;
-    strm->writem(isDir ? 0 : *dataOffset, 4);
-    strm->writem(isDir ? totalChildren + currEntry : node.data.len, 4);
-    ++currEntry;
-
-    int oldOffset = strm->offset();
-
-    // write to string table
-    strm->seek(*strOffset);
-    for(char ch : node.name)
-        strm->writem((uint8_t)ch, 1);
-    strm->writem(0, 1);
-    *strOffset += node.name.length() + 1;
-
-    // write data to data offset
-    if(writeData && !isDir && node.data.len > 0) {
-        strm->seek(*dataOffset);
-        uint8_t *buffer = new uint8_t[node.data.len];
-        node.data.read(buffer);
-        strm->write(buffer, node.data.len);
-        delete[] buffer;
+void fst::buildIndex() {
+    unsigned count = entries.size();
+    unsigned size = nall::bit::round(nall::max(count * 2, 16u));
+    pathIndex.reset();
+    nameIndex.reset();
+    pathIndex.resize(size);
+    nameIndex.resize(size);
+
+    // A path hashes the same as its parent's path followed by "/" and the
+    // name, so each entry's hash follows from its parent's.
+    uint32_t *pathHash = new uint32_t[count];
+    pathHash[0] = 2166136261u;
+    for(unsigned n = 1; n < count; n++) {
+        const entry &e = entries[n];
+        uint32_t h = pathHash[e.parent];
+        if(e.parent != 0) h = hash(h, "/", 1);
+        h = pathHash[n] = hash(h, name(n), strlen(name(n)));
+
+        unsigned i = h & (size - 1);
+        while(pathIndex[i].index) i = (i + 1) & (size - 1);
+        pathIndex[i].hash = h;
+        pathIndex[i].index = n + 1;
+
+        h = hash((2166136261u ^ e.parent) * 16777619u, name(n), strlen(name(n)));
+        i = h & (size - 1);
+        while(nameIndex[i].index) i = (i + 1) & (size - 1);
+        nameIndex[i].hash = h;
+        nameIndex[i].index = n + 1;
     }
-    *dataOffset += node.data.len;
+    delete[] pathHash;
+    indexed = true;
+}
 
-    // return to fst
-    strm->seek(oldOffset);
+nall::optional<unsigned> fst::find(const char *path) {
+    while(*path == '/') path++;
+    unsigned length = strlen(path);
+    while(length && path[length - 1] == '/') length--;
+    if(length == 0)
+        return { true, 0u };
+
+    // Without an index, walk down one directory at a time.
+    if(lazy) {
+        unsigned dir = 0;
+        while(true) {
+            unsigned component = 0;
+            while(component < length && path[component] != '/')
+                component++;
+            nall::optional<unsigned> child = findChild(dir, path, component);
+            if(!child || component == length)
+                return { child.valid, child.value };
+            dir = child.value;
+            path += component + 1;
+            length -= component + 1;
+        }
+    }
 
-    for(entry &child : node.children)
-        recursiveWrite(strm, child, strOffset, dataOffset, writeData);
+    if(!indexed)
+        buildIndex();
+    unsigned mask = pathIndex.size() - 1;
+    uint32_t h = hash(2166136261u, path, length);
+    for(unsigned i = h & mask; pathIndex[i].index; i = (i + 1) & mask) {
+        if(pathIndex[i].hash == h && matchesPath(pathIndex[i].index - 1, path, length))
+            return { true, pathIndex[i].index - 1 };
+    }
+    return { false, 0u };
 }
 
-void fst::recursivePreflight(fst::entry &node, unsigned *fileCount, unsigned *strTableSize) {
-    *fileCount += 1;
+nall::optional<unsigned> fst::find(unsigned dir, const char *name) {
+    return findChild(dir, name, strlen(name));
+}
 
-    if(*fileCount > 1 && strTableSize)
-        strTableSize += node.name.length() + 1;
+nall::optional<unsigned> fst::findChild(unsigned dir, const char *name, unsigned length) {
+    if(lazy) {
+        entry e = at(dir);
+        for(unsigned n = dir + 1; e.directory && n < e.next; n = at(n).next) {
+            if(strlen(this->name(n)) == length && equal(this->name(n), name, length))
+                return { true, n };
+        }
+        return { false, 0u };
+    }
 
-    for(entry &child : node.children)
-        recursivePreflight(child, fileCount, strTableSize);
+    if(!indexed)
+        buildIndex();
+    unsigned mask = nameIndex.size() - 1;
+    uint32_t h = hash((2166136261u ^ dir) * 16777619u, name, length);
+    for(unsigned i = h & mask; nameIndex[i].index; i = (i + 1) & mask) {
+        unsigned index = nameIndex[i].index - 1;
+        if(nameIndex[i].hash == h && entries[index].parent == dir
+        && strlen(this->name(index)) == length && equal(this->name(index), name, length))
+            return { true, index };
+    }
+    return { false, 0u };
 }
 
 unsigned fst::fileCount() {
-	unsigned count = 0;
-	recursivePreflight(root, &count);
-	return count;
+    return lazy ? rawCount : entries.size();
 }
 
-bool fst::read(nall::stream *strm) {
-    uint32_t fileCount;
+bool fst::read(nall::stream *strm, uint64_t size, bool lazy) {
+    image = strm;
+    clear();
+    rawTable.reset();
+    this->lazy = borrowed = false;
     fstOffset = strm->offset();
 
+    uint64_t available = strm->size() > fstOffset ? strm->size() - fstOffset : 0;
+    if(available < 0xc) {
+        nall::print("error: FST lies past the end of the image\n");
+        return false;
+    }
+
     // read root entry
-    if(strm->read() != 1)
+    RawEntry raw;
+    layout::decode(raw, strm->view(fstOffset, 0xc));
+    if(raw.flags != 1)
         nall::print("warning: unexpected root flag\n");
-    if(strm->readm(3) != 0)
+    if(raw.nameOffset != 0)
         nall::print("warning: unexpected root string offset\n");
-    if(strm->readm(4) != 0)
+    if(raw.offset != 0)
         nall::print("warning: unexpected root offset\n");
 
-    fileCount = strm->readm(4);
-    strTableOffset = fileCount * 0xC + fstOffset;
+    unsigned fileCount = nall::max(raw.length, 1u);
+    uint64_t tableSize = (uint64_t)fileCount * 0xc;
+    if(tableSize > available) {
+        nall::print("error: FST entries run past the end of the image\n");
+        return false;
+    }
+    strTableOffset = fstOffset + tableSize;
+
+    // Entries and names come in with one view. The size in the header is
+    // not always kept up to date by rebuilding tools, so if the names
+    // reach past it, they are fetched again with the table.
+    uint64_t length = nall::min(nall::max(size, tableSize), available);
+    const uint8_t *table = strm->view(fstOffset, length);
+    uint64_t lastName = 0;
+    for(unsigned n = 1; n < fileCount; n++)
+        lastName = nall::max(lastName, (uint64_t)layout::bigendian<3>::load(table + n * 0xc + 1));
+    bool complete = tableSize + lastName < length
+        && memchr(table + tableSize + lastName, 0, length - tableSize - lastName);
+    if(!complete && length < available) {
+        length = nall::min(tableSize + lastName + 256, available);
+        table = strm->view(fstOffset, length);
+    }
 
-    currEntry = 1;
+    strm->seek(fstOffset + length);
+    if(!lazy)
+        return decode(table, length);
 
-    while(currEntry < fileCount) {
-        fst::entry file;
-        recursiveRead(strm, file);
+    borrowed = strm->data() && table == strm->data() + fstOffset;
+    if(!borrowed) {
+        rawTable.resize(length);
+        memcpy(rawTable.data(), table, length);
+    }
+    rawCount = fileCount;
+    rawSize = length;
+    this->lazy = true;
 
-        root.children.append(file);
+    entry root = { intern("", 0), 0, fileCount, ~0u, 0, 0, true };
+    entries.append(root);
+    return true;
+}
+
+bool fst::materialize() {
+    if(!lazy)
+        return true;
+    lazy = false;
+    bool ok = decode(raw(), rawSize);
+    rawTable.reset();
+    borrowed = false;
+    return ok;
+}
+
+// Decodes a whole FST, already known to hold its entry table, into entries.
+bool fst::decode(const uint8_t *table, uint64_t length) {
+    RawEntry raw;
+    layout::decode(raw, table);
+    unsigned fileCount = nall::max(raw.length, 1u);
+    uint64_t tableSize = (uint64_t)fileCount * 0xc;
+    const char *strTable = (const char*)table + tableSize;
+    uint64_t strTableSize = length - tableSize;
+
+    // The pool starts with the root's empty name, then the string table
+    // as is, so a name's pool offset is its disc offset plus one.
+    clear();
+    names.reserve(strTableSize + 1);
+    names.resize(strTableSize + 1);
+    memcpy(names.data() + 1, strTable, strTableSize);
+
+    entry root = { 0, 0, fileCount, ~0u, 0, 0, true };
+    entries.reserve(fileCount);
+    entries.append(root);
+
+    // Directories are closed off as the index passes their end; one that
+    // claims to run past its parent is cut short there.
+    unsigned dir = 0;
+    for(unsigned n = 1; n < fileCount; n++) {
+        layout::decode(raw, table + n * 0xc);
+        while(n >= entries[dir].next)
+            dir = entries[dir].parent;
+
+        const char *name = strTable + raw.nameOffset;
+        const char *nameEnd = raw.nameOffset < strTableSize
+            ? (const char*)memchr(name, 0, strTableSize - raw.nameOffset) : 0;
+        if(!nameEnd) {
+            nall::print("error: FST name runs past the end of the string table\n");
+            return false;
+        }
+
+        entry e = { raw.nameOffset + 1, dir, n + 1, ~0u, 0, 0, raw.flags == 1 };
+        if(e.directory) {
+            e.next = nall::min(nall::max(raw.length, n + 1), entries[dir].next);
+            dir = n;
+        } else {
+            e.offset = raw.offset;
+            e.length = raw.length;
+        }
+        entries.append(e);
     }
 
+    buildIndex();
     return true;
 }
 
-bool fst::write(nall::stream *strm, bool writeData) {
-    unsigned fileCount = 0, strTableSize = 0, strTablePtr = 0, dataPtr = 0;
-    fstOffset = strm->offset();
+// buffer is allocated on first use, at transferSize(), and reused for every
+// payload after that; the caller frees it.
+bool fst::writePayload(nall::stream *strm, unsigned index, uint64_t offset, uint8_t *&buffer) {
+    if(onPayload) {
+        onPayload(index, offset);
+        return true;
+    }
+
+    dataref data = this->data(index);
+
+    // Let the kernel move the data when it comes from a file.
+    uint64_t copied = 0;
+    nall::file source;
+    if(data.type == fileref && source.open(data.filename, nall::file::mode::read))
+        copied = strm->copyAt(offset, source.handle(), data.off, data.len);
+
+    // Whatever is left goes through the shared buffer.
+    if(copied == data.len)
+        return true;
+    unsigned size = transferSize(~0ull);
+    if(!buffer)
+        buffer = new uint8_t[size];
+    bool ok = true;
+    strm->seek(offset + copied);
+    for(uint64_t position = copied; ok && position < data.len; position += size) {
+        unsigned chunk = nall::min((uint64_t)size, data.len - position);
+        ok = source.open()
+           ? source.pread(data.off + position, buffer, chunk) == chunk
+           : data.readAt(position, buffer, chunk);
+        if(ok) strm->write(buffer, chunk);
+    }
+    return ok;
+}
+
+unsigned fst::packing::of(const char *name, bool packed) const {
+    unsigned length = strlen(name);
+    for(auto &r : rules) {
+        unsigned n = r.extension.length();
+        if(n <= length && equal(name + length - n, r.extension, n))
+            return r.alignment;
+    }
+    return packed ? packAlignment : alignment;
+}
 
-    if(!strm->writable())
+unsigned fst::packing::largest() const {
+    unsigned result = nall::max(alignment, packBelow ? packAlignment : 0);
+    for(auto &r : rules)
+        result = nall::max(result, r.alignment);
+    return result;
+}
+
+bool fst::plan(placement &p, uint64_t fstOffset) {
+    if(!materialize())
         return false;
 
-    recursivePreflight(root, &fileCount, &strTableSize);
+    unsigned fileCount = entries.size();
+    p.fstOffset = fstOffset;
+    p.nameOffset.reset();
+    p.dataOffset.reset();
+    p.order.reset();
+    p.nameOffset.reserve(fileCount);
+    p.dataOffset.reserve(fileCount);
+    p.order.reserve(fileCount);
+
+    uint64_t strPtr = 0;
+    for(unsigned n = 0; n < fileCount; n++) {
+        if(!fitsOnDisc(strPtr, 3) || !fitsOnDisc(entries[n].length))
+            return false;
+        p.nameOffset.append(n ? strPtr : 0);
+        p.dataOffset.append(0);
+        if(n) strPtr += strlen(name(n)) + 1;
+    }
 
-    // write root entry
-    strm->writem(1, 1);
-    strm->writem(0, 3);
-    strm->writem(0, 4);
-    strm->writem(fileCount, 4);
+    // Data is placed relative to where it starts, which depends on the size
+    // of the names. The start gets the largest alignment in use, so every
+    // relative alignment holds on disc as well.
+    struct gap {
+        uint64_t start, end;
+    };
+    nall::vector<gap> gaps;
+    nall::vector<bool> placed;
+    placed.reserve(fileCount);
+    for(unsigned n = 0; n < fileCount; n++)
+        placed.append(entries[n].directory);
+    uint64_t dataPtr = 0, lastData = 0;
+
+    auto append = [&](unsigned n) {
+        unsigned alignment = policy.of(name(n));
+        uint64_t at = (dataPtr + alignment - 1) & ~(uint64_t)(alignment - 1);
+        if(policy.packBelow && at > dataPtr)
+            gaps.append({ dataPtr, at });
+        p.dataOffset[n] = at;
+        placed[n] = true;
+        lastData = nall::max(lastData, at);
+        dataPtr = at + entries[n].length;
+    };
 
-    currEntry = 1;
+    // Files listed in placeFirst go first, in that order and whatever their
+    // size, then the rest in table order; small ones are held back.
+    for(unsigned n : placeFirst)
+        if(n < fileCount && !placed[n]) append(n);
+    for(unsigned n = 1; n < fileCount; n++)
+        if(!placed[n] && entries[n].length >= policy.packBelow) append(n);
+
+    // Then the small files, each into the first gap it fits, looking a
+    // short way ahead; gaps too small for anything are skipped for good.
+    unsigned firstGap = 0;
+    for(unsigned n = 1; n < fileCount; n++) {
+        const entry &e = entries[n];
+        if(placed[n])
+            continue;
+        unsigned alignment = policy.of(name(n), true);
+        uint64_t at = ~0ull;
+        for(unsigned g = firstGap; g < gaps.size() && g < firstGap + 64; g++) {
+            uint64_t start = (gaps[g].start + alignment - 1) & ~(uint64_t)(alignment - 1);
+            if(start + e.length <= gaps[g].end) {
+                at = start;
+                gaps[g].start = start + e.length;
+                break;
+            }
+        }
+        while(firstGap < gaps.size() && gaps[firstGap].end - gaps[firstGap].start < 32)
+            firstGap++;
+        if(at == ~0ull) {
+            at = (dataPtr + alignment - 1) & ~(uint64_t)(alignment - 1);
+            dataPtr = at + e.length;
+        }
+        p.dataOffset[n] = at;
+        lastData = nall::max(lastData, at);
+    }
+
+    for(unsigned n = 1; n < fileCount; n++)
+        if(!entries[n].directory) p.order.append(n);
+    const uint64_t *offset = p.dataOffset.data();
+    nall::sort(p.order.data(), p.order.size(), [=](uint32_t a, uint32_t b) {
+        return offset[a] < offset[b];
+    });
+
+    unsigned largest = policy.largest();
+    p.size = fileCount * 0xc + strPtr;
+    p.dataStart = (fstOffset + p.size + largest - 1) & ~(uint64_t)(largest - 1);
+    p.dataEnd = p.dataStart + dataPtr;
+    return fitsOnDisc(p.size) && fitsOnDisc(p.dataStart + lastData);
+}
+
+bool fst::write(nall::stream *strm, const placement &p, bool writeData) {
+    unsigned fileCount = entries.size();
+    if(!strm->writable() || lazy || p.nameOffset.size() != fileCount)
+        return false;
+
+    fstOffset = p.fstOffset;
     strTableOffset = fstOffset + fileCount * 0xc;
-    strTablePtr = strTableOffset;
-    dataPtr = strTableOffset + strTableSize;
-    dataPtr = (dataPtr + (4096 - 1)) & -4096;
 
-    for(entry e : root.children)
-        recursiveWrite(strm, e, &strTablePtr, &dataPtr, writeData);
+    // Both tables are built in memory and go out in one write; file data
+    // follows in disc order.
+    uint8_t *table = new uint8_t[p.size];
+    uint8_t *strTable = table + fileCount * 0xc;
+
+    RawEntry raw = { 1, 0, 0, fileCount };
+    layout::encode(raw, table);
+
+    for(unsigned n = 1; n < fileCount; n++) {
+        const entry &e = entries[n];
+        raw.flags = e.directory ? 1 : 0;
+        raw.nameOffset = p.nameOffset[n];
+        raw.offset = e.directory ? e.parent : p.dataStart + p.dataOffset[n];
+        raw.length = e.directory ? e.next : e.length;
+        layout::encode(raw, table + n * 0xc);
+        memcpy(strTable + p.nameOffset[n], name(n), strlen(name(n)) + 1);
+    }
 
-    return true;
+    strm->seek(fstOffset);
+    strm->write(table, p.size);
+    delete[] table;
+
+    bool ok = true;
+    uint8_t *buffer = 0;
+    for(unsigned i = 0; ok && writeData && i < p.order.size(); i++) {
+        unsigned n = p.order[i];
+        if(entries[n].length > 0)
+            ok = writePayload(strm, n, p.dataStart + p.dataOffset[n], buffer);
+    }
+    delete[] buffer;
+
+    return ok;
+}
+
+bool fst::write(nall::stream *strm, bool writeData) {
+    placement p;
+    return strm->writable() && plan(p, strm->offset()) && write(strm, p, writeData);
 }
 
-fst::fst() {
+fst::fst()
+: image(0), interned(0), lazy(false), borrowed(false), rawCount(0), rawSize(0), indexed(false),
+  fstOffset(0), strTableOffset(0) {
+    entry root = { intern("", 0), 0, 1, ~0u, 0, 0, true };
+    entries.append(root);
 }
 
 fst::~fst() {
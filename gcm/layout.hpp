@@ -0,0 +1,151 @@
+/*
+ * layout.hpp - (C) 2012-2013 jchadwick <johnwchadwick@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * --
+ *
+ * Everything on disc is big-endian and tightly packed, which doesn't match
+ * how the structs are laid out in memory. Each structure gets described once
+ * as a list of (offset, member) fields, and the whole thing is then decoded
+ * from, or encoded to, one contiguous buffer, so a header costs one stream
+ * call instead of one per field.
+ */
+
+namespace layout {
+
+// Spelled out per width, so they are recognized as single swapped loads and
+// stores rather than compiled as byte loops.
+template<unsigned Bytes> struct bigendian;
+
+template<> struct bigendian<1> {
+    static uint32_t load(const uint8_t *p) { return p[0]; }
+    static void store(uint32_t v, uint8_t *p) { p[0] = v; }
+};
+
+template<> struct bigendian<2> {
+    static uint32_t load(const uint8_t *p) { return p[0] << 8 | p[1]; }
+    static void store(uint32_t v, uint8_t *p) { p[0] = v >> 8; p[1] = v; }
+};
+
+template<> struct bigendian<3> {
+    static uint32_t load(const uint8_t *p) { return p[0] << 16 | p[1] << 8 | p[2]; }
+    static void store(uint32_t v, uint8_t *p) { p[0] = v >> 16; p[1] = v >> 8; p[2] = v; }
+};
+
+template<> struct bigendian<4> {
+    static uint32_t load(const uint8_t *p) { return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+    static void store(uint32_t v, uint8_t *p) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+};
+
+template<typename T, unsigned Bytes = sizeof(T)> struct scalar {
+    static const unsigned size = Bytes;
+
+    static void decode(T &value, const uint8_t *p) { value = bigendian<Bytes>::load(p); }
+    static void encode(const T &value, uint8_t *p) { bigendian<Bytes>::store(value, p); }
+};
+
+template<typename T, unsigned N, unsigned Bytes> struct scalar<T[N], Bytes> {
+    static const unsigned size = N * sizeof(T);
+
+    static void decode(T (&value)[N], const uint8_t *p) {
+        for(unsigned n = 0; n < N; n++) scalar<T>::decode(value[n], p + n * sizeof(T));
+    }
+
+    static void encode(const T (&value)[N], uint8_t *p) {
+        for(unsigned n = 0; n < N; n++) scalar<T>::encode(value[n], p + n * sizeof(T));
+    }
+};
+
+template<unsigned N, unsigned Bytes> struct scalar<uint8_t[N], Bytes> {
+    static const unsigned size = N;
+
+    static void decode(uint8_t (&value)[N], const uint8_t *p) { memcpy(value, p, N); }
+    static void encode(const uint8_t (&value)[N], uint8_t *p) { memcpy(p, value, N); }
+};
+
+// One member of Owner, stored at Offset. Bytes narrows integers that are
+// shorter on disc than in memory (the 24-bit FST name offset.)
+template<unsigned Offset, typename Owner, typename Type, Type Owner::*Member, unsigned Bytes = sizeof(Type)>
+struct field {
+    typedef scalar<Type, Bytes> codec;
+    static const unsigned offset = Offset;
+    static const unsigned end = Offset + codec::size;
+
+    static void decode(Owner &owner, const uint8_t *p) { codec::decode(owner.*Member, p + Offset); }
+    static void encode(const Owner &owner, uint8_t *p) { codec::encode(owner.*Member, p + Offset); }
+};
+
+#define GCM_FIELD(offset, owner, member) \
+    layout::field<offset, owner, decltype(owner::member), &owner::member>
+
+// Fields must be listed in order, must not overlap and must fit in the record.
+template<typename... Fields> struct ordered {
+    static const bool value = true;
+};
+
+template<typename A, typename B, typename... Fields> struct ordered<A, B, Fields...> {
+    static const bool value = A::end <= B::offset && ordered<B, Fields...>::value;
+};
+
+template<unsigned Size, typename... Fields> struct within {
+    static const bool value = true;
+};
+
+template<unsigned Size, typename Field, typename... Fields> struct within<Size, Field, Fields...> {
+    static const bool value = Field::end <= Size && within<Size, Fields...>::value;
+};
+
+template<typename Owner, unsigned Size, typename... Fields> struct record {
+    static const unsigned size = Size;
+    static_assert(ordered<Fields...>::value, "layout fields overlap or are out of order");
+    static_assert(within<Size, Fields...>::value, "layout fields run past the end of the record");
+
+    static void decode(Owner &owner, const uint8_t *p) {
+        int expand[] = {0, (Fields::decode(owner, p), 0)...};
+        (void)expand;
+    }
+
+    // Bytes not covered by any field are written as zero.
+    static void encode(const Owner &owner, uint8_t *p) {
+        memset(p, 0, Size);
+        int expand[] = {0, (Fields::encode(owner, p), 0)...};
+        (void)expand;
+    }
+};
+
+// Specialized next to each on-disc structure.
+template<typename T> struct of;
+
+template<typename T> void decode(T &value, const uint8_t *p) { of<T>::decode(value, p); }
+template<typename T> void encode(const T &value, uint8_t *p) { of<T>::encode(value, p); }
+
+// Decodes one record at the stream's current offset and steps past it;
+// false if the record runs past the end of the stream.
+template<typename T> bool read(nall::stream *strm, T &value) {
+    uint64_t offset = strm->offset();
+    const uint8_t *p = strm->view(offset, of<T>::size);
+    if(!p)
+        return false;
+    of<T>::decode(value, p);
+    strm->seek(offset + of<T>::size);
+    return true;
+}
+
+template<typename T> void write(nall::stream *strm, const T &value) {
+    uint8_t buffer[of<T>::size];
+    of<T>::encode(value, buffer);
+    strm->write(buffer, of<T>::size);
+}
+
+} // namespace layout
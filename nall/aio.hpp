@@ -0,0 +1,292 @@
+#ifndef NALL_AIO_HPP
+#define NALL_AIO_HPP
+
+//asynchronous positional file I/O
+//keeps up to depth() reads and writes in flight at once, on io_uring where the
+//kernel provides it and on a small pool of threads doing pread/pwrite elsewhere.
+//completion callbacks always run on the thread that calls into aio (from read(),
+//write() or wait()), never concurrently, and may queue further requests.
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <nall/file.hpp>
+#include <nall/function.hpp>
+#include <nall/stdint.hpp>
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #define NALL_AIO_URING
+    #include <errno.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+    #include <linux/io_uring.h>
+  #endif
+#endif
+
+namespace nall {
+
+struct aio {
+  typedef function<void (bool)> callback;
+
+  bool uring() const { return puring; }
+  unsigned depth() const { return pdepth; }
+  bool failed() const { return pfailed; }
+
+  void read(int handle, uint64_t offset, uint8_t *data, unsigned length, const callback &done = callback()) {
+    submit(handle, offset, data, length, false, done);
+  }
+
+  void write(int handle, uint64_t offset, const uint8_t *data, unsigned length, const callback &done = callback()) {
+    submit(handle, offset, (uint8_t*)data, length, true, done);
+  }
+
+  //blocks until at least one request completes; returns false if none was in flight
+  bool waitany() {
+    if(!pinflight) return false;
+    reap(true);
+    return true;
+  }
+
+  //blocks until every queued request, including any queued by callbacks, has completed
+  void wait() {
+    while(pinflight) reap(true);
+  }
+
+  aio(unsigned depth = 32, bool useuring = true) : pdepth(depth ? depth : 1), puring(false), pfailed(false), pinflight(0), pstop(false) {
+    prequest = new request[pdepth];
+    for(unsigned n = 0; n < pdepth; n++) pfree.push_back(pdepth - 1 - n);
+    #if defined(NALL_AIO_URING)
+    pringfd = -1;
+    if(useuring) puring = uring_open();
+    #endif
+    if(!puring) {
+      unsigned workers = min(pdepth, 16u);
+      for(unsigned n = 0; n < workers; n++) pworker.push_back(std::thread([this] { work(); }));
+    }
+  }
+
+  ~aio() {
+    wait();
+    if(!puring) {
+      { std::lock_guard<std::mutex> lock(pmutex); pstop = true; }
+      pqueued.notify_all();
+      for(auto &worker : pworker) worker.join();
+    }
+    #if defined(NALL_AIO_URING)
+    uring_close();
+    #endif
+    delete[] prequest;
+  }
+
+  aio(const aio&) = delete;
+  aio& operator=(const aio&) = delete;
+
+private:
+  struct request {
+    int handle;
+    uint64_t offset;
+    uint8_t *data;
+    unsigned length;
+    unsigned transferred;
+    bool write;
+    callback done;
+    #if defined(NALL_AIO_URING)
+    struct iovec iov;
+    #endif
+  };
+
+  unsigned pdepth;
+  bool puring;
+  bool pfailed;
+  unsigned pinflight;
+  request *prequest;
+  std::vector<unsigned> pfree;
+
+  //thread pool
+  std::vector<std::thread> pworker;
+  std::mutex pmutex;
+  std::condition_variable pqueued, pcompleted;
+  std::deque<unsigned> pqueue;
+  std::vector<std::pair<unsigned, unsigned>> pdone;
+  bool pstop;
+
+  void submit(int handle, uint64_t offset, uint8_t *data, unsigned length, bool write, const callback &done) {
+    while(pfree.empty()) reap(true);
+    unsigned index = pfree.back();
+    pfree.pop_back();
+
+    request &r = prequest[index];
+    r.handle = handle, r.offset = offset, r.data = data, r.length = length;
+    r.transferred = 0, r.write = write, r.done = done;
+    pinflight++;
+    issue(index);
+  }
+
+  void issue(unsigned index) {
+    #if defined(NALL_AIO_URING)
+    if(puring) return uring_issue(index);
+    #endif
+    { std::lock_guard<std::mutex> lock(pmutex); pqueue.push_back(index); }
+    pqueued.notify_one();
+  }
+
+  void finish(unsigned index, bool ok) {
+    callback done = prequest[index].done;
+    prequest[index].done.reset();
+    pfree.push_back(index);
+    pinflight--;
+    if(!ok) pfailed = true;
+    if(done) done(ok);
+  }
+
+  void reap(bool block) {
+    #if defined(NALL_AIO_URING)
+    if(puring) return uring_reap(block);
+    #endif
+    std::vector<std::pair<unsigned, unsigned>> batch;
+    {
+      std::unique_lock<std::mutex> lock(pmutex);
+      if(block) pcompleted.wait(lock, [this] { return !pdone.empty(); });
+      batch.swap(pdone);
+    }
+    for(auto &item : batch) finish(item.first, item.second == prequest[item.first].length);
+  }
+
+  void work() {
+    while(true) {
+      unsigned index;
+      {
+        std::unique_lock<std::mutex> lock(pmutex);
+        pqueued.wait(lock, [this] { return pstop || !pqueue.empty(); });
+        if(pqueue.empty()) return;
+        index = pqueue.front();
+        pqueue.pop_front();
+      }
+      request &r = prequest[index];
+      unsigned result = r.write
+      ? file::pwrite(r.handle, r.offset, r.data, r.length)
+      : file::pread(r.handle, r.offset, r.data, r.length);
+      {
+        std::lock_guard<std::mutex> lock(pmutex);
+        pdone.push_back({index, result});
+      }
+      pcompleted.notify_one();
+    }
+  }
+
+  #if defined(NALL_AIO_URING)
+  int pringfd;
+  uint8_t *psqring, *pcqring;
+  size_t psqsize, pcqsize;
+  io_uring_sqe *psqes;
+  unsigned psqecount;
+  unsigned *psqhead, *psqtail, *psqmask, *psqarray;
+  unsigned *pcqhead, *pcqtail, *pcqmask;
+  io_uring_cqe *pcqes;
+  unsigned ppending;
+
+  bool uring_open() {
+    psqring = pcqring = nullptr;
+    psqes = nullptr;
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+    pringfd = syscall(__NR_io_uring_setup, pdepth, &params);
+    if(pringfd < 0) return false;
+
+    psqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pcqsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) psqsize = pcqsize = max(psqsize, pcqsize);
+
+    psqring = (uint8_t*)mmap(0, psqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pringfd, IORING_OFF_SQ_RING);
+    pcqring = single ? psqring : (uint8_t*)mmap(0, pcqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pringfd, IORING_OFF_CQ_RING);
+    psqecount = params.sq_entries;
+    psqes = (io_uring_sqe*)mmap(0, psqecount * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pringfd, IORING_OFF_SQES);
+    if(psqring == MAP_FAILED || pcqring == MAP_FAILED || psqes == MAP_FAILED) {
+      uring_close();
+      return false;
+    }
+
+    psqhead  = (unsigned*)(psqring + params.sq_off.head);
+    psqtail  = (unsigned*)(psqring + params.sq_off.tail);
+    psqmask  = (unsigned*)(psqring + params.sq_off.ring_mask);
+    psqarray = (unsigned*)(psqring + params.sq_off.array);
+    pcqhead  = (unsigned*)(pcqring + params.cq_off.head);
+    pcqtail  = (unsigned*)(pcqring + params.cq_off.tail);
+    pcqmask  = (unsigned*)(pcqring + params.cq_off.ring_mask);
+    pcqes    = (io_uring_cqe*)(pcqring + params.cq_off.cqes);
+    ppending = 0;
+    return true;
+  }
+
+  void uring_close() {
+    if(pringfd < 0) return;
+    if(psqes && psqes != MAP_FAILED) munmap(psqes, psqecount * sizeof(io_uring_sqe));
+    if(pcqring && pcqring != MAP_FAILED && pcqring != psqring) munmap(pcqring, pcqsize);
+    if(psqring && psqring != MAP_FAILED) munmap(psqring, psqsize);
+    ::close(pringfd);
+    pringfd = -1;
+  }
+
+  void uring_issue(unsigned index) {
+    request &r = prequest[index];
+    r.iov.iov_base = r.data + r.transferred;
+    r.iov.iov_len = r.length - r.transferred;
+
+    unsigned tail = *psqtail;
+    unsigned slot = tail & *psqmask;
+    io_uring_sqe &sqe = psqes[slot];
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe.fd = r.handle;
+    sqe.off = r.offset + r.transferred;
+    sqe.addr = (uintptr_t)&r.iov;
+    sqe.len = 1;
+    sqe.user_data = index;
+    psqarray[slot] = slot;
+    __atomic_store_n(psqtail, tail + 1, __ATOMIC_RELEASE);
+
+    //submit in small batches, so the device starts working before the queue is full
+    if(++ppending >= max(1u, pdepth / 4)) uring_enter(0);
+  }
+
+  void uring_enter(unsigned wait) {
+    int result = syscall(__NR_io_uring_enter, pringfd, ppending, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if(result >= 0) ppending -= min((unsigned)result, ppending);
+  }
+
+  void uring_reap(bool block) {
+    uring_enter(block && !uring_ready() ? 1 : 0);
+    while(true) {
+      unsigned head = *pcqhead;
+      if(head == __atomic_load_n(pcqtail, __ATOMIC_ACQUIRE)) break;
+      io_uring_cqe cqe = pcqes[head & *pcqmask];
+      __atomic_store_n(pcqhead, head + 1, __ATOMIC_RELEASE);
+
+      unsigned index = cqe.user_data;
+      request &r = prequest[index];
+      if(cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        uring_issue(index);
+      } else if(cqe.res > 0 && r.transferred + cqe.res < r.length) {
+        r.transferred += cqe.res;  //short transfer: queue the remainder
+        uring_issue(index);
+      } else {
+        finish(index, cqe.res >= 0 && r.transferred + cqe.res == r.length);
+      }
+    }
+  }
+
+  bool uring_ready() const {
+    return *pcqhead != __atomic_load_n(pcqtail, __ATOMIC_ACQUIRE);
+  }
+  #endif
+};
+
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef NALL_BUFFERPOOL_HPP
+#define NALL_BUFFERPOOL_HPP
+
+//fixed set of equally sized, aligned buffers that are handed out and returned
+//instead of being allocated per transfer. all buffers are allocated up front,
+//so the memory used never grows past count() * size(), however much data
+//passes through. acquire() and release() may be called from any thread.
+
+#include <mutex>
+#include <vector>
+
+#include <nall/stdint.hpp>
+
+namespace nall {
+
+struct bufferpool {
+  enum : unsigned { alignment = 4096 };
+
+  unsigned count() const { return pbuffers.size(); }
+  unsigned size() const { return psize; }
+
+  bool available() const {
+    std::lock_guard<std::mutex> lock(pmutex);
+    return !pfree.empty();
+  }
+
+  //returns nullptr when every buffer is in use
+  uint8_t* acquire() {
+    std::lock_guard<std::mutex> lock(pmutex);
+    if(pfree.empty()) return nullptr;
+    uint8_t *data = pfree.back();
+    pfree.pop_back();
+    return data;
+  }
+
+  void release(uint8_t *data) {
+    std::lock_guard<std::mutex> lock(pmutex);
+    pfree.push_back(data);
+  }
+
+  bufferpool(unsigned count, unsigned size) : psize(size) {
+    for(unsigned n = 0; n < count; n++) {
+      uint8_t *data = allocate(size);
+      if(!data) break;
+      pbuffers.push_back(data);
+      pfree.push_back(data);
+    }
+  }
+
+  ~bufferpool() {
+    for(auto data : pbuffers) deallocate(data);
+  }
+
+  bufferpool(const bufferpool&) = delete;
+  bufferpool& operator=(const bufferpool&) = delete;
+
+private:
+  unsigned psize;
+  std::vector<uint8_t*> pbuffers;
+  std::vector<uint8_t*> pfree;
+  mutable std::mutex pmutex;
+
+  static uint8_t* allocate(unsigned length) {
+    #if defined(_WIN32)
+    return (uint8_t*)_aligned_malloc(length, alignment);
+    #else
+    void *data = nullptr;
+    if(posix_memalign(&data, alignment, length)) return nullptr;
+    return (uint8_t*)data;
+    #endif
+  }
+
+  static void deallocate(uint8_t *data) {
+    #if defined(_WIN32)
+    _aligned_free(data);
+    #else
+    ::free(data);
+    #endif
+  }
+};
+
+}
+
+#endif
@@ -8,6 +8,19 @@
 #include <nall/windows/utf8.hpp>
 #include <nall/stream/memory.hpp>
 
+#if !defined(_WIN32)
+  #include <fcntl.h>
+#endif
+#if defined(__linux__)
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #if defined(__has_include)
+    #if __has_include(<linux/fs.h>)
+      #include <linux/fs.h>
+    #endif
+  #endif
+#endif
+
 namespace nall {
   inline FILE* fopen_utf8(const string &utf8_filename, const char *mode) {
     #if !defined(_WIN32)
@@ -29,7 +42,7 @@ namespace nall {
       file rd, wr;
       if(rd.open(sourcename, mode::read) == false) return false;
       if(wr.open(targetname, mode::write) == false) return false;
-      for(unsigned n = 0; n < rd.size(); n++) wr.write(rd.read());
+      for(uint64_t n = 0; n < rd.size(); n++) wr.write(rd.read());
       return true;
     }
 
@@ -45,14 +58,14 @@ namespace nall {
       return unlink(filename) == 0;
     }
 
-    static bool truncate(const string &filename, unsigned size) {
+    static bool truncate(const string &filename, uint64_t size) {
       #if !defined(_WIN32)
-      return truncate(filename, size) == 0;
+      return ::truncate(filename, size) == 0;
       #else
       bool result = false;
       FILE *fp = fopen(filename, "rb+");
       if(fp) {
-        result = _chsize(fileno(fp), size) == 0;
+        result = _chsize_s(fileno(fp), size) == 0;
         fclose(fp);
       }
       return result;
@@ -152,6 +165,98 @@ namespace nall {
 
     void write(const uint8_t *buffer, unsigned length) {
       file_offset += fwrite(buffer, 1, length, fp);
+      if(file_offset > file_size) file_size = file_offset;
+    }
+
+    //positional transfers: neither use nor move the stdio position, so they may
+    //run concurrently with each other. stdio writes still sitting in the buffer
+    //are not visible to pread(); flush() first when mixing the two.
+    unsigned pread(uint64_t offset, uint8_t *buffer, unsigned length) const {
+      if(!fp) return 0;  //file not open
+      return pread(fileno(fp), offset, buffer, length);
+    }
+
+    unsigned pwrite(uint64_t offset, const uint8_t *buffer, unsigned length) {
+      if(!fp) return 0;  //file not open
+      if(file_mode == mode::read) return 0;  //writes not permitted
+      fflush(fp);  //land pending stdio writes first, and drop buffered reads this may overwrite
+      unsigned total = pwrite(fileno(fp), offset, buffer, length);
+      if(offset + total > file_size) file_size = offset + total;
+      return total;
+    }
+
+    //copies length bytes from another descriptor into the file at offset
+    //without passing them through user space; see the static form below.
+    uint64_t copy(uint64_t offset, int source, uint64_t sourceoffset, uint64_t length) {
+      if(!fp) return 0;  //file not open
+      if(file_mode == mode::read) return 0;  //writes not permitted
+      fflush(fp);
+      uint64_t total = copy(source, sourceoffset, fileno(fp), offset, length);
+      if(offset + total > file_size) file_size = offset + total;
+      return total;
+    }
+
+    //in-kernel copy between descriptors: shares the blocks outright (a reflink)
+    //where the filesystem supports it and the offsets are block aligned, and
+    //copies inside the kernel otherwise. returns how much was copied, which is
+    //less than length, often zero, when the kernel can't do it; the caller
+    //moves the rest itself.
+    static uint64_t copy(int source, uint64_t sourceoffset, int target, uint64_t targetoffset, uint64_t length) {
+      uint64_t total = 0;
+      #if defined(FICLONERANGE)
+      if(sourceoffset % 4096 == 0 && targetoffset % 4096 == 0) {
+        //a partial last block can only be cloned when it ends the source file
+        for(uint64_t clone : {length, length & ~(uint64_t)4095}) {
+          file_clone_range range = {source, sourceoffset, clone, targetoffset};
+          if(clone && ioctl(target, FICLONERANGE, &range) == 0) { total = clone; break; }
+        }
+      }
+      #endif
+      #if defined(__NR_copy_file_range)
+      while(total < length) {
+        loff_t in = sourceoffset + total, out = targetoffset + total;
+        long result = syscall(__NR_copy_file_range, source, &in, target, &out, min(length - total, (uint64_t)1 << 30), 0);
+        if(result <= 0) break;
+        total += result;
+      }
+      #endif
+      return total;
+    }
+
+    static unsigned pread(int handle, uint64_t offset, uint8_t *buffer, unsigned length) {
+      unsigned total = 0;
+      while(total < length) {
+        #if !defined(_WIN32)
+        ssize_t result = ::pread(handle, buffer + total, length - total, offset + total);
+        if(result <= 0) break;
+        #else
+        OVERLAPPED overlapped = {0};
+        overlapped.Offset = (offset + total) & 0xffffffff;
+        overlapped.OffsetHigh = (offset + total) >> 32;
+        DWORD result = 0;
+        if(!ReadFile((HANDLE)_get_osfhandle(handle), buffer + total, length - total, &result, &overlapped) || !result) break;
+        #endif
+        total += result;
+      }
+      return total;
+    }
+
+    static unsigned pwrite(int handle, uint64_t offset, const uint8_t *buffer, unsigned length) {
+      unsigned total = 0;
+      while(total < length) {
+        #if !defined(_WIN32)
+        ssize_t result = ::pwrite(handle, buffer + total, length - total, offset + total);
+        if(result <= 0) break;
+        #else
+        OVERLAPPED overlapped = {0};
+        overlapped.Offset = (offset + total) & 0xffffffff;
+        overlapped.OffsetHigh = (offset + total) >> 32;
+        DWORD result = 0;
+        if(!WriteFile((HANDLE)_get_osfhandle(handle), buffer + total, length - total, &result, &overlapped) || !result) break;
+        #endif
+        total += result;
+      }
+      return total;
     }
 
     template<typename... Args> void print(Args... args) {
@@ -164,46 +269,84 @@ namespace nall {
       fflush(fp);
     }
 
-    void seek(int offset, index index_ = index::absolute) {
+    int handle() const {
+      if(!fp) return -1;  //file not open
+      return fileno(fp);
+    }
+
+    void seek(int64_t offset, index index_ = index::absolute) {
       if(!fp) return;  //file not open
 
-      uintmax_t req_offset = file_offset;
+      int64_t req_offset = file_offset;
       switch(index_) {
         case index::absolute: req_offset  = offset; break;
         case index::relative: req_offset += offset; break;
       }
 
       if(req_offset < 0) req_offset = 0;  //cannot seek before start of file
-      if(req_offset > file_size) {
+      if((uint64_t)req_offset > file_size) {
         if(file_mode == mode::read) {     //cannot seek past end of file
           req_offset = file_size;
-        } else {                          //pad file to requested location
+        } else if(!truncate(req_offset)) {  //extend file to requested location, as a hole
+          p_seek(file_size);
           file_offset = file_size;
-          while(file_size < req_offset) write(0x00);
+          while(file_size < (uint64_t)req_offset) write(0x00);
         }
       }
 
-      if(fseek(fp, req_offset, SEEK_SET) == 0)
+      if(p_seek(req_offset) == 0)
           file_offset = req_offset;
     }
 
-    unsigned offset() const {
+    uint64_t offset() const {
       if(!fp) return 0;  //file not open
       return file_offset;
     }
 
-    unsigned size() const {
+    uint64_t size() const {
       if(!fp) return 0;  //file not open
       return file_size;
     }
 
-    bool truncate(unsigned size) {
+    bool truncate(uint64_t size) {
       if(!fp) return false;  //file not open
+      fflush(fp);
       #if !defined(_WIN32)
-      return ftruncate(fileno(fp), size) == 0;
+      if(ftruncate(fileno(fp), size) != 0) return false;
       #else
-      return _chsize(fileno(fp), size) == 0;
+      if(_chsize_s(fileno(fp), size) != 0) return false;
       #endif
+      file_size = size;
+      return true;
+    }
+
+    //clears a range to zero without moving the file position, extending the
+    //file if needed. where the filesystem allows it, no data is written: the
+    //range becomes a hole.
+    bool zero(uint64_t offset, uint64_t length) {
+      if(!fp) return false;  //file not open
+      if(file_mode == mode::read) return false;  //writes not permitted
+      fflush(fp);
+      uint64_t existing = file_size;
+      if(offset + length > file_size && !truncate(offset + length)) return false;
+      if(offset < existing) {
+        if(!zero(fileno(fp), offset, min(offset + length, existing) - offset)) return false;
+        p_seek(file_offset);  //discard stale stdio buffers
+      }
+      return true;
+    }
+
+    static bool zero(int handle, uint64_t offset, uint64_t length) {
+      #if defined(FALLOC_FL_PUNCH_HOLE)
+      if(fallocate(handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) return true;
+      #endif
+      static const uint8_t zeroes[64 * 1024] = {0};
+      while(length) {
+        unsigned chunk = min(length, (uint64_t)sizeof zeroes);
+        if(pwrite(handle, offset, zeroes, chunk) != chunk) return false;
+        offset += chunk, length -= chunk;
+      }
+      return true;
     }
 
     bool end() {
@@ -269,9 +412,14 @@ namespace nall {
       }
       if(!fp) return false;
       file_offset = 0;
-      fseek(fp, 0, SEEK_END);
-      file_size = ftell(fp);
-      fseek(fp, 0, SEEK_SET);
+      #if !defined(_WIN32)
+      fseeko(fp, 0, SEEK_END);
+      file_size = ftello(fp);
+      #else
+      _fseeki64(fp, 0, SEEK_END);
+      file_size = _ftelli64(fp);
+      #endif
+      p_seek(0);
       return true;
     }
 
@@ -297,9 +445,17 @@ namespace nall {
 
   private:
     FILE *fp;
-    unsigned file_offset;
-    unsigned file_size;
+    uint64_t file_offset;
+    uint64_t file_size;
     mode file_mode;
+
+    int p_seek(uint64_t offset) {
+      #if !defined(_WIN32)
+      return fseeko(fp, offset, SEEK_SET);
+      #else
+      return _fseeki64(fp, offset, SEEK_SET);
+      #endif
+    }
   };
 /*
   struct file {
@@ -25,15 +25,16 @@ namespace nall {
     bool open() const { return p_open(); }
     bool open(const char *filename, mode mode_) { return p_open(filename, mode_); }
     void close() { return p_close(); }
-    unsigned size() const { return p_size; }
+    uint64_t size() const { return p_size; }
     uint8_t* data() { return p_handle; }
     const uint8_t* data() const { return p_handle; }
+    int handle() const { return p_descriptor(); }
     filemap() : p_size(0), p_handle(0) { p_ctor(); }
     filemap(const char *filename, mode mode_) : p_size(0), p_handle(0) { p_ctor(); p_open(filename, mode_); }
     ~filemap() { p_dtor(); }
 
   private:
-    unsigned p_size;
+    uint64_t p_size;
     uint8_t *p_handle;
 
     #if defined(_WIN32)
@@ -47,6 +48,10 @@ namespace nall {
       return p_handle;
     }
 
+    int p_descriptor() const {
+      return -1;
+    }
+
     bool p_open(const char *filename, mode mode_) {
       if(file::exists(filename) && file::size(filename) == 0) {
         p_handle = 0;
@@ -89,9 +94,11 @@ namespace nall {
         creation_disposition, FILE_ATTRIBUTE_NORMAL, NULL);
       if(p_filehandle == INVALID_HANDLE_VALUE) return false;
 
-      p_size = GetFileSize(p_filehandle, NULL);
+      LARGE_INTEGER p_filesize;
+      GetFileSizeEx(p_filehandle, &p_filesize);
+      p_size = p_filesize.QuadPart;
 
-      p_maphandle = CreateFileMapping(p_filehandle, NULL, flprotect, 0, p_size, NULL);
+      p_maphandle = CreateFileMapping(p_filehandle, NULL, flprotect, p_size >> 32, p_size & 0xffffffff, NULL);
       if(p_maphandle == INVALID_HANDLE_VALUE) {
         CloseHandle(p_filehandle);
         p_filehandle = INVALID_HANDLE_VALUE;
@@ -139,6 +146,10 @@ namespace nall {
       return p_handle;
     }
 
+    int p_descriptor() const {
+      return p_fd;
+    }
+
     bool p_open(const char *filename, mode mode_) {
       if(file::exists(filename) && file::size(filename) == 0) {
         p_handle = 0;
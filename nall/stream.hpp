@@ -17,6 +17,9 @@
 #include <nall/stream/memory.hpp>
 #include <nall/stream/mmap.hpp>
 #include <nall/stream/file.hpp>
+#include <nall/stream/buffered.hpp>
+#include <nall/stream/direct.hpp>
+#include <nall/stream/pipe.hpp>
 #include <nall/stream/http.hpp>
 #include <nall/stream/gzip.hpp>
 #include <nall/stream/zip.hpp>
@@ -12,11 +12,11 @@ inline std::unique_ptr<stream> makestream(const string &path) {
   return std::unique_ptr<stream>(new mmapstream(path));
 }
 
-inline std::unique_ptr<stream> makestream(uint8_t *data, unsigned size) {
+inline std::unique_ptr<stream> makestream(uint8_t *data, uint64_t size) {
   return std::unique_ptr<stream>(new memorystream(data, size));
 }
 
-inline std::unique_ptr<stream> makestream(const uint8_t *data, unsigned size) {
+inline std::unique_ptr<stream> makestream(const uint8_t *data, uint64_t size) {
   return std::unique_ptr<stream>(new memorystream(data, size));
 }
 
@@ -0,0 +1,202 @@
+#ifndef NALL_STREAM_BUFFERED_HPP
+#define NALL_STREAM_BUFFERED_HPP
+
+#include <nall/file.hpp>
+
+namespace nall {
+
+//filestream with a single block-sized window in front of the file.
+//reads fill whole blocks (and hint the next block to the kernel once access
+//looks sequential); writes are absorbed into the window and written back as
+//one contiguous run when the window moves, on flush() or on destruction.
+struct bufferedstream : stream {
+  using stream::read;
+  using stream::write;
+
+  enum : unsigned { defaultblocksize = 64 * 1024 };
+
+  bool seekable() const { return true; }
+  bool readable() const { return true; }
+  bool writable() const { return pwritable; }
+  bool randomaccess() const { return false; }
+  bool positional() const { return true; }
+
+  int handle() const { flush(); return pfile.handle(); }
+  uint64_t size() const { return pvalid ? max(pfile.size(), pbase + pvalid) : pfile.size(); }
+  uint64_t offset() const { return poffset; }
+  void seek(uint64_t offset) const { poffset = offset; }
+
+  uint8_t read() const {
+    if(!hit(poffset) && !fill(poffset)) return 0xff;
+    return pbuffer[poffset++ - pbase];
+  }
+
+  void write(uint8_t data) const {
+    if(!absorbs(poffset)) restart(poffset);
+    put(&data, 1);
+  }
+
+  void read(uint8_t *data, unsigned length) const {
+    while(length) {
+      if(!hit(poffset)) {
+        //large reads skip the window entirely
+        if(length >= pblocksize) {
+          flush();
+          pfile.seek(poffset);
+          unsigned actual = min((uint64_t)length, pfile.size() > poffset ? pfile.size() - poffset : 0);
+          pfile.read(data, actual);
+          memset(data + actual, 0xff, length - actual);
+          poffset += length;
+          return;
+        }
+        if(!fill(poffset)) {
+          memset(data, 0xff, length);
+          poffset += length;
+          return;
+        }
+      }
+      unsigned chunk = min((uint64_t)length, pbase + pvalid - poffset);
+      memcpy(data, pbuffer + (poffset - pbase), chunk);
+      data += chunk, length -= chunk, poffset += chunk;
+    }
+  }
+
+  void write(const uint8_t *data, unsigned length) const {
+    if(length >= pblocksize) {
+      flush();
+      invalidate(poffset, length);
+      pfile.seek(poffset);
+      pfile.write(data, length);
+      poffset += length;
+      return;
+    }
+    while(length) {
+      if(!absorbs(poffset)) restart(poffset);
+      unsigned chunk = min(length, pblocksize - (unsigned)(poffset - pbase));
+      put(data, chunk);
+      data += chunk, length -= chunk;
+    }
+  }
+
+  //positional reads only touch the window when write-behind data is pending,
+  //which never happens on a stream that is only being read.
+  unsigned readAt(uint64_t offset, uint8_t *data, unsigned length) const {
+    if(pdirtyhi > pdirtylo) flush();
+    return pfile.pread(offset, data, length);
+  }
+
+  unsigned writeAt(uint64_t offset, const uint8_t *data, unsigned length) const {
+    if(pdirtyhi > pdirtylo) flush();
+    invalidate(offset, length);
+    return pfile.pwrite(offset, data, length);
+  }
+
+  uint64_t copyAt(uint64_t offset, int source, uint64_t sourceoffset, uint64_t length) const {
+    if(pdirtyhi > pdirtylo) flush();
+    invalidate(offset, length);
+    return pfile.copy(offset, source, sourceoffset, length);
+  }
+
+  void zero(uint64_t offset, uint64_t length) const {
+    if(pdirtyhi > pdirtylo) flush();
+    invalidate(offset, length);
+    pfile.zero(offset, length);
+  }
+
+  //writes back any pending data; the window itself stays valid for reads.
+  void flush() const {
+    if(pdirtyhi > pdirtylo) {
+      pfile.seek(pbase + pdirtylo);
+      pfile.write(pbuffer + pdirtylo, pdirtyhi - pdirtylo);
+      pfile.flush();
+    }
+    pdirtylo = pdirtyhi = 0;
+  }
+
+  bufferedstream(const string &filename, unsigned blocksize = defaultblocksize) {
+    pfile.open(filename, file::mode::readwrite);
+    pwritable = pfile.open();
+    if(!pwritable) pfile.open(filename, file::mode::read);
+    construct(blocksize);
+  }
+
+  bufferedstream(const string &filename, file::mode mode, unsigned blocksize = defaultblocksize) {
+    pfile.open(filename, mode);
+    pwritable = mode == file::mode::write || mode == file::mode::readwrite;
+    construct(blocksize);
+  }
+
+  ~bufferedstream() {
+    flush();
+    delete[] pbuffer;
+  }
+
+private:
+  mutable file pfile;
+  bool pwritable;
+
+  uint8_t *pbuffer;
+  unsigned pblocksize;
+  mutable uint64_t poffset, pbase;
+  mutable unsigned pvalid, pdirtylo, pdirtyhi;
+  mutable uint64_t pnextfill;
+
+  void construct(unsigned blocksize) {
+    pblocksize = blocksize ? blocksize : (unsigned)defaultblocksize;
+    pbuffer = new uint8_t[pblocksize];
+    poffset = pbase = 0;
+    pvalid = pdirtylo = pdirtyhi = 0;
+    pnextfill = ~0ull;
+  }
+
+  bool hit(uint64_t offset) const {
+    return offset >= pbase && offset < pbase + pvalid;
+  }
+
+  //a write can join the window if it lands inside or directly after the known bytes
+  bool absorbs(uint64_t offset) const {
+    return offset >= pbase && offset <= pbase + pvalid && offset < pbase + pblocksize;
+  }
+
+  bool fill(uint64_t offset) const {
+    flush();
+    pbase = offset - offset % pblocksize;
+    pvalid = 0;
+    if(pbase >= pfile.size()) return false;
+
+    pfile.seek(pbase);
+    pvalid = min((uint64_t)pblocksize, pfile.size() - pbase);
+    pfile.read(pbuffer, pvalid);
+
+    #if defined(POSIX_FADV_WILLNEED)
+    if(pbase == pnextfill) posix_fadvise(pfile.handle(), pbase + pblocksize, pblocksize, POSIX_FADV_WILLNEED);
+    #endif
+    pnextfill = pbase + pblocksize;
+    return offset < pbase + pvalid;
+  }
+
+  void restart(uint64_t offset) const {
+    flush();
+    pbase = offset;
+    pvalid = 0;
+  }
+
+  void put(const uint8_t *data, unsigned length) const {
+    unsigned position = poffset - pbase;
+    memcpy(pbuffer + position, data, length);
+    if(pdirtyhi == pdirtylo) pdirtylo = position, pdirtyhi = position;
+    pdirtylo = min(pdirtylo, position);
+    pdirtyhi = max(pdirtyhi, position + length);
+    pvalid = max(pvalid, position + length);
+    poffset += length;
+  }
+
+  //drops the window if a direct write is about to overtake it
+  void invalidate(uint64_t offset, uint64_t length) const {
+    if(offset < pbase + pvalid && offset + length > pbase) pvalid = 0;
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef NALL_STREAM_DIRECT_HPP
+#define NALL_STREAM_DIRECT_HPP
+
+#include <nall/file.hpp>
+
+#if !defined(_WIN32)
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace nall {
+
+//file stream that bypasses the page cache, for writing large outputs without
+//evicting everything else from memory. data passes through one aligned window
+//and reaches the disk only as whole, aligned blocks; partial blocks at either
+//edge of a write are completed from the file first. the unaligned tail at the
+//very end of the file goes through an ordinary buffered descriptor instead.
+//where the platform or filesystem has no direct I/O, this degrades into a
+//plain windowed file stream.
+struct directstream : stream {
+  using stream::read;
+  using stream::write;
+
+  enum : unsigned { alignment = 4096, defaultwindowsize = 1024 * 1024 };
+
+  bool seekable() const { return true; }
+  bool readable() const { return true; }
+  bool writable() const { return pwritable; }
+  bool randomaccess() const { return false; }
+
+  //the descriptor only accepts aligned transfers, so it is not handed out
+  int handle() const { return -1; }
+  uint64_t size() const { return psize; }
+  uint64_t offset() const { return poffset; }
+  void seek(uint64_t offset) const { poffset = offset; }
+
+  uint8_t read() const {
+    if(!hit(poffset) && !fill(poffset)) return 0xff;
+    return pbuffer[poffset++ - pbase];
+  }
+
+  void write(uint8_t data) const {
+    if(!absorbs(poffset)) restart(poffset);
+    put(&data, 1);
+  }
+
+  void read(uint8_t *data, unsigned length) const {
+    while(length) {
+      if(!hit(poffset) && !fill(poffset)) {
+        memset(data, 0xff, length);
+        poffset += length;
+        return;
+      }
+      unsigned chunk = min((uint64_t)length, pbase + pknown - poffset);
+      memcpy(data, pbuffer + (poffset - pbase), chunk);
+      data += chunk, length -= chunk, poffset += chunk;
+    }
+  }
+
+  void write(const uint8_t *data, unsigned length) const {
+    while(length) {
+      if(!absorbs(poffset)) restart(poffset);
+      unsigned chunk = min(length, pwindowsize - (unsigned)(poffset - pbase));
+      put(data, chunk);
+      data += chunk, length -= chunk;
+    }
+  }
+
+  unsigned readAt(uint64_t offset, uint8_t *data, unsigned length) const {
+    uint64_t saved = poffset;
+    poffset = offset;
+    read(data, length);
+    poffset = saved;
+    return min((uint64_t)length, psize > offset ? psize - offset : 0);
+  }
+
+  unsigned writeAt(uint64_t offset, const uint8_t *data, unsigned length) const {
+    uint64_t saved = poffset;
+    poffset = offset;
+    write(data, length);
+    poffset = saved;
+    return length;
+  }
+
+  void zero(uint64_t offset, uint64_t length) const {
+    flush();
+    if(offset < pbase + pknown && offset + length > pbase) pknown = 0;
+    uint64_t existing = psize;
+    if(offset + length > psize && pfile.truncate(offset + length)) psize = offset + length;
+    if(offset < existing) file::zero(pfile.handle(), offset, min(offset + length, existing) - offset);
+  }
+
+  //writes back any pending data; the window itself stays valid for reads.
+  void flush() const {
+    if(pdirtyhi <= pdirtylo) return;
+
+    unsigned lo = pdirtylo - pdirtylo % alignment;
+    unsigned hi = pdirtyhi;
+    unsigned end = hi;
+    if(pbase + hi < psize) {
+      //complete the last block, without writing past the end of the file
+      end = min((uint64_t)align(hi), psize - pbase);
+      if(end > pknown) {
+        unsigned block = hi - hi % alignment;
+        unsigned actual = file::pread(pdirect, pbase + block, pscratch, alignment);
+        memset(pscratch + actual, 0, alignment - actual);
+        memcpy(pbuffer + hi, pscratch + hi % alignment, end - hi);
+        pknown = end;
+      }
+    }
+
+    unsigned tail = end - end % alignment;
+    if(tail > lo) file::pwrite(pdirect, pbase + lo, pbuffer + lo, tail - lo);
+    if(end > tail) file::pwrite(pfile.handle(), pbase + tail, pbuffer + tail, end - tail);
+    pdirtylo = pdirtyhi = 0;
+  }
+
+  directstream(const string &filename, file::mode mode, unsigned windowsize = defaultwindowsize) {
+    pfile.open(filename, mode);
+    pwritable = mode == file::mode::write || mode == file::mode::readwrite;
+    pdirect = pfile.handle();
+    pownsdirect = false;
+
+    #if defined(O_DIRECT)
+    int direct = ::open(filename, (pwritable ? O_RDWR : O_RDONLY) | O_DIRECT);
+    if(direct >= 0) pdirect = direct, pownsdirect = true;
+    #elif defined(F_NOCACHE)
+    int direct = ::open(filename, pwritable ? O_RDWR : O_RDONLY);
+    if(direct >= 0) fcntl(direct, F_NOCACHE, 1), pdirect = direct, pownsdirect = true;
+    #endif
+
+    pwindowsize = max(windowsize - windowsize % alignment, (unsigned)alignment);
+    pbuffer = allocate(pwindowsize);
+    pscratch = allocate(alignment);
+    psize = pfile.open() ? pfile.size() : 0;
+    poffset = pbase = 0;
+    pknown = pdirtylo = pdirtyhi = 0;
+  }
+
+  ~directstream() {
+    flush();
+    #if !defined(_WIN32)
+    if(pownsdirect) ::close(pdirect);
+    #endif
+    release(pbuffer);
+    release(pscratch);
+  }
+
+private:
+  mutable file pfile;
+  bool pwritable;
+  int pdirect;
+  bool pownsdirect;
+
+  uint8_t *pbuffer, *pscratch;
+  unsigned pwindowsize;
+  mutable uint64_t psize, poffset, pbase;
+  mutable unsigned pknown, pdirtylo, pdirtyhi;
+
+  static unsigned align(unsigned offset) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+  }
+
+  static uint8_t* allocate(unsigned length) {
+    #if defined(_WIN32)
+    return (uint8_t*)_aligned_malloc(length, alignment);
+    #else
+    void *data = nullptr;
+    if(posix_memalign(&data, alignment, length)) return nullptr;
+    return (uint8_t*)data;
+    #endif
+  }
+
+  static void release(uint8_t *data) {
+    #if defined(_WIN32)
+    _aligned_free(data);
+    #else
+    free(data);
+    #endif
+  }
+
+  bool hit(uint64_t offset) const {
+    return offset >= pbase && offset < pbase + pknown;
+  }
+
+  //a write can join the window if it lands inside it with nothing unknown in
+  //between. a gap past the end of the file is known to be zero and is filled
+  //in, unless it spans a whole block, which is better left as a hole.
+  bool absorbs(uint64_t offset) const {
+    if(offset < pbase || offset >= pbase + pwindowsize) return false;
+    if(offset <= pbase + pknown) return true;
+    unsigned position = offset - pbase;
+    return pbase + pknown >= psize && position - position % alignment <= align(pknown);
+  }
+
+  bool fill(uint64_t offset) const {
+    flush();
+    pbase = offset - offset % alignment;
+    pknown = 0;
+    if(pbase >= psize) return false;
+    pknown = file::pread(pdirect, pbase, pbuffer, pwindowsize);
+    return offset < pbase + pknown;
+  }
+
+  //moves the window to an aligned base at or before offset, loading the
+  //block offset falls into so the bytes in front of it are known.
+  void restart(uint64_t offset) const {
+    flush();
+    pbase = offset - offset % alignment;
+    pknown = 0;
+    if(offset > pbase && pbase < psize) {
+      pknown = file::pread(pdirect, pbase, pbuffer, alignment);
+    }
+  }
+
+  void put(const uint8_t *data, unsigned length) const {
+    unsigned position = poffset - pbase;
+    unsigned from = min(position, pknown);
+    if(position > pknown) memset(pbuffer + pknown, 0, position - pknown);
+    memcpy(pbuffer + position, data, length);
+    if(pdirtyhi == pdirtylo) pdirtylo = from, pdirtyhi = from;
+    pdirtylo = min(pdirtylo, from);
+    pdirtyhi = max(pdirtyhi, position + length);
+    pknown = max(pknown, position + length);
+    poffset += length;
+    psize = max(psize, poffset);
+  }
+};
+
+}
+
+#endif
@@ -13,24 +13,31 @@ struct filestream : stream {
   bool readable() const { return true; }
   bool writable() const { return pwritable; }
   bool randomaccess() const { return false; }
+  bool positional() const { return true; }
 
-  unsigned size() const { return pfile.size(); }
-  unsigned offset() const { return pfile.offset(); }
-  void seek(unsigned offset) const { pfile.seek(offset); }
+  int handle() const { sync(); return pfile.handle(); }
+  uint64_t size() const { return pfile.size(); }
+  uint64_t offset() const { return pfile.offset(); }
+  void seek(uint64_t offset) const { pfile.seek(offset); }
 
   uint8_t read() const { return pfile.read(); }
-  void write(uint8_t data) const { pfile.write(data); }
+  void write(uint8_t data) const { pdirty = true; pfile.write(data); }
 
   void read(uint8_t *data, unsigned length) const { pfile.read(data, length); }
-  void write(uint8_t *data, unsigned length) const { pfile.write(data, length); }
+  void write(const uint8_t *data, unsigned length) const { pdirty = true; pfile.write(data, length); }
 
-  filestream(const string &filename) {
+  unsigned readAt(uint64_t offset, uint8_t *data, unsigned length) const { sync(); return pfile.pread(offset, data, length); }
+  unsigned writeAt(uint64_t offset, const uint8_t *data, unsigned length) const { return pfile.pwrite(offset, data, length); }
+  uint64_t copyAt(uint64_t offset, int source, uint64_t sourceoffset, uint64_t length) const { return pfile.copy(offset, source, sourceoffset, length); }
+  void zero(uint64_t offset, uint64_t length) const { pfile.zero(offset, length); }
+
+  filestream(const string &filename) : pdirty(false) {
     pfile.open(filename, file::mode::readwrite);
     pwritable = pfile.open();
     if(!pwritable) pfile.open(filename, file::mode::read);
   }
 
-  filestream(const string &filename, file::mode mode) {
+  filestream(const string &filename, file::mode mode) : pdirty(false) {
     pfile.open(filename, mode);
     pwritable = mode == file::mode::write || mode == file::mode::readwrite;
   }
@@ -38,6 +45,14 @@ struct filestream : stream {
 private:
   mutable file pfile;
   bool pwritable;
+  mutable bool pdirty;
+
+  //stdio writes sit in the FILE buffer until flushed, out of sight of the
+  //descriptor; flushing only when there are some keeps positional reads
+  //clear of the stdio lock
+  void sync() const {
+    if(pdirty) pfile.flush(), pdirty = false;
+  }
 };
 
 }
@@ -14,15 +14,15 @@ struct httpstream : stream {
   bool writable() const { return true; }
   bool randomaccess() const { return true; }
 
-  unsigned size() const { return psize; }
-  unsigned offset() const { return poffset; }
-  void seek(unsigned offset) const { poffset = offset; }
+  uint64_t size() const { return psize; }
+  uint64_t offset() const { return poffset; }
+  void seek(uint64_t offset) const { poffset = offset; }
 
   uint8_t read() const { return pdata[poffset++]; }
   void write(uint8_t data) const { pdata[poffset++] = data; }
 
-  uint8_t read(unsigned offset) const { return pdata[offset]; }
-  void write(unsigned offset, uint8_t data) const { pdata[offset] = data; }
+  uint8_t read(uint64_t offset) const { return pdata[offset]; }
+  void write(uint64_t offset, uint8_t data) const { pdata[offset] = data; }
 
   httpstream(const string &url, unsigned port) : pdata(nullptr), psize(0), poffset(0) {
     string uri = url;
@@ -41,7 +41,8 @@ struct httpstream : stream {
 
 private:
   mutable uint8_t *pdata;
-  mutable unsigned psize, poffset;
+  mutable unsigned psize;
+  mutable uint64_t poffset;
 };
 
 }
@@ -13,36 +13,62 @@ struct memorystream : stream {
   bool readable() const { return true; }
   bool writable() const { return pwritable; }
   bool randomaccess() const { return true; }
+  bool positional() const { return true; }
 
   uint8_t *data() const { return pdata; }
-  unsigned size() const { return psize; }
-  unsigned offset() const { return poffset; }
-  void seek(unsigned offset) const { poffset = offset; }
+  uint64_t size() const { return psize; }
+  uint64_t offset() const { return poffset; }
+  void seek(uint64_t offset) const { poffset = offset; }
 
   uint8_t read() const { return pdata[poffset++]; }
   void write(uint8_t data) const { pdata[poffset++] = data; }
 
-  uint8_t read(unsigned offset) const { return pdata[offset]; }
-  void write(unsigned offset, uint8_t data) const { pdata[offset] = data; }
+  uint8_t read(uint64_t offset) const { return pdata[offset]; }
+  void write(uint64_t offset, uint8_t data) const { pdata[offset] = data; }
 
   void read(uint8_t *data, unsigned length) const { memcpy(data, pdata + poffset, length); poffset += length; }
-  void write(uint8_t *data, unsigned length) const { memcpy(pdata + poffset, data, length); poffset += length; }
+  void write(const uint8_t *data, unsigned length) const { memcpy(pdata + poffset, data, length); poffset += length; }
+
+  const uint8_t* view(uint64_t offset, unsigned length) const {
+    if(offset > psize || length > psize - offset) return nullptr;
+    return pdata + offset;
+  }
+
+  unsigned readAt(uint64_t offset, uint8_t *data, unsigned length) const {
+    if(offset >= psize) return 0;
+    length = min((uint64_t)length, psize - offset);
+    memcpy(data, pdata + offset, length);
+    return length;
+  }
+
+  unsigned writeAt(uint64_t offset, const uint8_t *data, unsigned length) const {
+    if(offset >= psize) return 0;
+    length = min((uint64_t)length, psize - offset);
+    memcpy(pdata + offset, data, length);
+    return length;
+  }
+
+  void zero(uint64_t offset, uint64_t length) const {
+    if(offset >= psize) return;
+    memset(pdata + offset, 0, min(length, psize - offset));
+  }
 
   memorystream() : pdata(nullptr), psize(0), poffset(0), pwritable(true) {}
 
-  memorystream(uint8_t *data, unsigned size) {
+  memorystream(uint8_t *data, uint64_t size) {
     pdata = data, psize = size, poffset = 0;
     pwritable = true;
   }
 
-  memorystream(const uint8_t *data, unsigned size) {
+  memorystream(const uint8_t *data, uint64_t size) {
     pdata = (uint8_t*)data, psize = size, poffset = 0;
     pwritable = false;
   }
 
 protected:
   mutable uint8_t *pdata;
-  mutable unsigned psize, poffset, pwritable;
+  mutable uint64_t psize, poffset;
+  mutable unsigned pwritable;
 };
 
 }
@@ -13,16 +13,46 @@ struct mmapstream : stream {
   bool readable() const { return true; }
   bool writable() const { return pwritable; }
   bool randomaccess() const { return true; }
+  bool positional() const { return true; }
 
-  unsigned size() const { return pmmap.size(); }
-  unsigned offset() const { return poffset; }
-  void seek(unsigned offset) const { poffset = offset; }
+  uint8_t* data() const { return pdata; }
+  int handle() const { return pmmap.handle(); }
+  uint64_t size() const { return pmmap.size(); }
+  uint64_t offset() const { return poffset; }
+  void seek(uint64_t offset) const { poffset = offset; }
 
   uint8_t read() const { return pdata[poffset++]; }
   void write(uint8_t data) const { pdata[poffset++] = data; }
 
-  uint8_t read(unsigned offset) const { return pdata[offset]; }
-  void write(unsigned offset, uint8_t data) const { pdata[offset] = data; }
+  uint8_t read(uint64_t offset) const { return pdata[offset]; }
+  void write(uint64_t offset, uint8_t data) const { pdata[offset] = data; }
+
+  void read(uint8_t *data, unsigned length) const { memcpy(data, pdata + poffset, length); poffset += length; }
+  void write(const uint8_t *data, unsigned length) const { memcpy(pdata + poffset, data, length); poffset += length; }
+
+  const uint8_t* view(uint64_t offset, unsigned length) const {
+    if(offset > pmmap.size() || length > pmmap.size() - offset) return nullptr;
+    return pdata + offset;
+  }
+
+  unsigned readAt(uint64_t offset, uint8_t *data, unsigned length) const {
+    if(offset >= pmmap.size()) return 0;
+    length = min((uint64_t)length, pmmap.size() - offset);
+    memcpy(data, pdata + offset, length);
+    return length;
+  }
+
+  unsigned writeAt(uint64_t offset, const uint8_t *data, unsigned length) const {
+    if(offset >= pmmap.size()) return 0;
+    length = min((uint64_t)length, pmmap.size() - offset);
+    memcpy(pdata + offset, data, length);
+    return length;
+  }
+
+  void zero(uint64_t offset, uint64_t length) const {
+    if(offset >= pmmap.size()) return;
+    memset(pdata + offset, 0, min(length, pmmap.size() - offset));
+  }
 
   mmapstream(const string &filename) {
     pmmap.open(filename, filemap::mode::readwrite);
@@ -31,10 +61,17 @@ struct mmapstream : stream {
     pdata = pmmap.data(), poffset = 0;
   }
 
+  mmapstream(const string &filename, filemap::mode mode) {
+    pmmap.open(filename, mode);
+    pwritable = mode != filemap::mode::read;
+    pdata = pmmap.data(), poffset = 0;
+  }
+
 private:
   mutable filemap pmmap;
   mutable uint8_t *pdata;
-  mutable unsigned pwritable, poffset;
+  mutable unsigned pwritable;
+  mutable uint64_t poffset;
 };
 
 }
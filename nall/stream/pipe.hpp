@@ -0,0 +1,113 @@
+#ifndef NALL_STREAM_PIPE_HPP
+#define NALL_STREAM_PIPE_HPP
+
+#if defined(_WIN32)
+  #include <fcntl.h>
+  #include <io.h>
+#else
+  #include <errno.h>
+  #include <unistd.h>
+#endif
+
+namespace nall {
+
+//read-only stream over a descriptor that can only be read front to back, such
+//as standard input or a pipe. seeking forward skips data; seeking backward is
+//not possible and is ignored. the size is unknown until the end is reached.
+struct pipestream : stream {
+  using stream::read;
+  using stream::write;
+
+  enum : unsigned { buffersize = 64 * 1024 };
+
+  bool seekable() const { return false; }
+  bool readable() const { return true; }
+  bool writable() const { return false; }
+  bool randomaccess() const { return false; }
+
+  uint64_t size() const { return peof ? pend : ~0ull; }
+  uint64_t offset() const { return poffset; }
+
+  void seek(uint64_t offset) const {
+    while(poffset < offset) {
+      if(pposition == plength && !fill()) { poffset = offset; return; }
+      unsigned skip = min(offset - poffset, (uint64_t)(plength - pposition));
+      pposition += skip, poffset += skip;
+    }
+  }
+
+  uint8_t read() const {
+    poffset++;
+    if(pposition == plength && !fill()) return 0xff;
+    return pbuffer[pposition++];
+  }
+
+  void write(uint8_t) const {}
+
+  void read(uint8_t *data, unsigned length) const {
+    poffset += length;
+    //drain what is buffered, then read large requests straight into place
+    unsigned chunk = min(length, plength - pposition);
+    memcpy(data, pbuffer + pposition, chunk);
+    pposition += chunk, data += chunk, length -= chunk;
+    if(length >= buffersize) {
+      unsigned actual = receive(data, length);
+      data += actual, length -= actual;
+    }
+    while(length && fill()) {
+      chunk = min(length, plength);
+      memcpy(data, pbuffer, chunk);
+      pposition = chunk, data += chunk, length -= chunk;
+    }
+    memset(data, 0xff, length);
+  }
+
+  pipestream(int handle = 0) : phandle(handle) {
+    #if defined(_WIN32)
+    _setmode(handle, _O_BINARY);
+    #endif
+    pbuffer = new uint8_t[buffersize];
+    pposition = plength = 0;
+    poffset = pend = 0;
+    peof = false;
+  }
+
+  ~pipestream() {
+    delete[] pbuffer;
+  }
+
+private:
+  int phandle;
+  uint8_t *pbuffer;
+  mutable unsigned pposition, plength;
+  mutable uint64_t poffset, pend;
+  mutable bool peof;
+
+  bool fill() const {
+    pposition = 0;
+    plength = receive(pbuffer, buffersize, true);
+    return plength;
+  }
+
+  //reads until length bytes arrive or the input ends; with partial set,
+  //returns as soon as anything is available.
+  unsigned receive(uint8_t *data, unsigned length, bool partial = false) const {
+    unsigned total = 0;
+    while(total < length && !peof) {
+      #if defined(_WIN32)
+      int result = ::_read(phandle, data + total, length - total);
+      #else
+      ssize_t result = ::read(phandle, data + total, length - total);
+      if(result < 0 && errno == EINTR) continue;
+      #endif
+      if(result <= 0) { peof = true; break; }
+      total += result, pend += result;
+      if(partial) break;
+    }
+    return total;
+  }
+};
+
+}
+
+#endif
@@ -8,17 +8,19 @@ struct stream {
   virtual bool readable() const = 0;
   virtual bool writable() const = 0;
   virtual bool randomaccess() const = 0;
+  virtual bool positional() const { return false; }
 
   virtual uint8_t* data() const { return nullptr; }
-  virtual unsigned size() const = 0;
-  virtual unsigned offset() const = 0;
-  virtual void seek(unsigned offset) const = 0;
+  virtual int handle() const { return -1; }
+  virtual uint64_t size() const = 0;
+  virtual uint64_t offset() const = 0;
+  virtual void seek(uint64_t offset) const = 0;
 
   virtual uint8_t read() const = 0;
   virtual void write(uint8_t data) const = 0;
 
-  virtual uint8_t read(unsigned) const { return 0; }
-  virtual void write(unsigned, uint8_t) const {}
+  virtual uint8_t read(uint64_t) const { return 0; }
+  virtual void write(uint64_t, uint8_t) const {}
 
   operator bool() const {
     return size();
@@ -67,24 +69,87 @@ struct stream {
     while(length--) write(*data++);
   }
 
+  //borrow length bytes starting at offset, without moving the stream offset.
+  //random access streams hand out a pointer into their own storage; all others
+  //copy into a bounce buffer owned by the stream, which is reused between calls.
+  //either way, the pointer is only valid until the next view() call. random
+  //access streams return nullptr for ranges that run past their end.
+  virtual const uint8_t* view(uint64_t offset, unsigned length) const {
+    if(length > pbouncesize) {
+      if(pbounce) delete[] pbounce;
+      pbounce = new uint8_t[pbouncesize = length];
+    }
+    uint64_t restore = this->offset();
+    seek(offset);
+    read(pbounce, length);
+    seek(restore);
+    return pbounce;
+  }
+
+  //read or write at offset without moving the stream offset; returns the number
+  //of bytes transferred. streams that report positional() implement these
+  //without shared state, so many threads may call them at once; the fallback
+  //below goes through seek() and is no safer than any other stream call.
+  virtual unsigned readAt(uint64_t offset, uint8_t *data, unsigned length) const {
+    uint64_t restore = this->offset();
+    seek(offset);
+    read(data, length);
+    seek(restore);
+    return length;
+  }
+
+  virtual unsigned writeAt(uint64_t offset, const uint8_t *data, unsigned length) const {
+    uint64_t restore = this->offset();
+    seek(offset);
+    write(data, length);
+    seek(restore);
+    return length;
+  }
+
+  //copy length bytes from a descriptor into the stream at offset inside the
+  //kernel, without moving the stream offset. returns how much was copied;
+  //streams that can't do this copy nothing and leave it to the caller.
+  virtual uint64_t copyAt(uint64_t, int, uint64_t, uint64_t) const {
+    return 0;
+  }
+
+  //clear length bytes at offset to zero without moving the stream offset.
+  //file streams leave a hole rather than writing the zeroes out, where the
+  //filesystem supports it.
+  virtual void zero(uint64_t offset, uint64_t length) const {
+    static const uint8_t zeroes[4096] = {0};
+    uint64_t restore = this->offset();
+    seek(offset);
+    while(length) {
+      unsigned chunk = min(length, (uint64_t)sizeof zeroes);
+      write(zeroes, chunk);
+      length -= chunk;
+    }
+    seek(restore);
+  }
+
   struct byte {
     operator uint8_t() const { return s.read(offset); }
     byte& operator=(uint8_t data) { s.write(offset, data); return *this; }
-    byte(const stream &s, unsigned offset) : s(s), offset(offset) {}
+    byte(const stream &s, uint64_t offset) : s(s), offset(offset) {}
 
   private:
     const stream &s;
-    const unsigned offset;
+    const uint64_t offset;
   };
 
-  byte operator[](unsigned offset) const {
+  byte operator[](uint64_t offset) const {
     return byte(*this, offset);
   }
 
-  stream() {}
-  virtual ~stream() {}
+  stream() : pbounce(nullptr), pbouncesize(0) {}
+  virtual ~stream() { if(pbounce) delete[] pbounce; }
   stream(const stream&) = delete;
   stream& operator=(const stream&) = delete;
+
+private:
+  mutable uint8_t *pbounce;
+  mutable unsigned pbouncesize;
 };
 
 }
@@ -14,24 +14,40 @@ struct vectorstream : stream {
   bool readable() const { return true; }
   bool writable() const { return pwritable; }
   bool randomaccess() const { return true; }
+  bool positional() const { return true; }
 
   uint8_t* data() const { return memory.data(); }
-  unsigned size() const { return memory.size(); }
-  unsigned offset() const { return poffset; }
-  void seek(unsigned offset) const { poffset = offset; }
+  uint64_t size() const { return memory.size(); }
+  uint64_t offset() const { return poffset; }
+  void seek(uint64_t offset) const { poffset = offset; }
 
   uint8_t read() const { return memory[poffset++]; }
   void write(uint8_t data) const { memory[poffset++] = data; }
 
-  uint8_t read(unsigned offset) const { return memory[offset]; }
-  void write(unsigned offset, uint8_t data) const { memory[offset] = data; }
+  uint8_t read(uint64_t offset) const { return memory[offset]; }
+  void write(uint64_t offset, uint8_t data) const { memory[offset] = data; }
+
+  unsigned readAt(uint64_t offset, uint8_t *data, unsigned length) const {
+    if(offset >= (uint64_t)memory.size()) return 0;
+    length = min((uint64_t)length, (uint64_t)memory.size() - offset);
+    memcpy(data, memory.data() + offset, length);
+    return length;
+  }
+
+  unsigned writeAt(uint64_t offset, const uint8_t *data, unsigned length) const {
+    if(offset >= (uint64_t)memory.size()) return 0;
+    length = min((uint64_t)length, (uint64_t)memory.size() - offset);
+    memcpy(memory.data() + offset, data, length);
+    return length;
+  }
 
   vectorstream(vector<uint8_t> &memory) : memory(memory), poffset(0), pwritable(true) {}
   vectorstream(const vector<uint8_t> &memory) : memory((vector<uint8_t>&)memory), poffset(0), pwritable(false) {}
 
 protected:
   vector<uint8_t> &memory;
-  mutable unsigned poffset, pwritable;
+  mutable uint64_t poffset;
+  mutable unsigned pwritable;
 };
 
 }
@@ -0,0 +1,71 @@
+#ifndef NALL_WORKPOOL_HPP
+#define NALL_WORKPOOL_HPP
+
+//runs a fixed list of independent tasks on several threads
+//tasks are dealt out round-robin, in the order given, so every thread starts
+//near the front of the list. each thread works through its own share from
+//the front; once that runs dry, it steals from the back of another share,
+//where the work furthest from being reached is. run() returns when every
+//task has finished.
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <nall/algorithm.hpp>
+#include <nall/function.hpp>
+
+namespace nall {
+
+struct workpool {
+  //called once per task, with the index of the thread running it
+  typedef function<void (unsigned task, unsigned thread)> job;
+
+  static void run(unsigned tasks, unsigned threads, const job &work) {
+    threads = max(1u, min(threads, tasks));
+    if(threads == 1) {
+      for(unsigned n = 0; n < tasks; n++) work(n, 0);
+      return;
+    }
+
+    std::vector<share> shares(threads);
+    for(unsigned n = 0; n < tasks; n++) shares[n % threads].tasks.push_back(n);
+    for(auto &s : shares) s.head = 0, s.tail = s.tasks.size();
+
+    std::vector<std::thread> workers;
+    for(unsigned t = 1; t < threads; t++) {
+      workers.push_back(std::thread([&, t] { drain(shares, t, work); }));
+    }
+    drain(shares, 0, work);
+    for(auto &worker : workers) worker.join();
+  }
+
+private:
+  struct share {
+    std::mutex lock;
+    std::vector<unsigned> tasks;
+    unsigned head, tail;
+  };
+
+  static void drain(std::vector<share> &shares, unsigned thread, const job &work) {
+    unsigned task;
+    while(take(shares[thread], task, false)) work(task, thread);
+
+    //no task ever spawns another, so once every share is empty the work is done
+    for(unsigned n = 1; n < shares.size();) {
+      if(take(shares[(thread + n) % shares.size()], task, true)) work(task, thread);
+      else n++;
+    }
+  }
+
+  static bool take(share &s, unsigned &task, bool steal) {
+    std::lock_guard<std::mutex> guard(s.lock);
+    if(s.head == s.tail) return false;
+    task = steal ? s.tasks[--s.tail] : s.tasks[s.head++];
+    return true;
+  }
+};
+
+}
+
+#endif
@@ -22,7 +22,7 @@ struct zip {
   void append(string filename, const uint8_t *data = nullptr, unsigned size = 0u) {
     filename.transform("\\", "/");
     uint32_t checksum = crc32_calculate(data, size);
-    directory.append({filename, checksum, size, fp.offset()});
+    directory.append({filename, checksum, size, (uint32_t)fp.offset()});
 
     fp.writel(0x04034b50, 4);         //signature
     fp.writel(0x0014, 2);             //minimum version (2.0)